@@ -2,12 +2,27 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #endif
-// TODO: Get Sleep function in other Operating Systems.
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 // Standard Libraries
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 
 // OpenGL Libraries.
 #define GLFW_INCLUDE_NONE
@@ -16,11 +31,49 @@
 
 #include <cglm/cglm.h> // OpenGL Maths for C
 
-//#define STB_IMAGE_IMPLEMENTATION
-//#include <stb/stb_image.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // SSE2 Intrinsics
+#define HAS_SSE2
+#endif
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h> // PDEP
+#define HAS_BMI2
+#endif
+
+// Platform
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#define atomicFetchAdd(p, v) InterlockedExchangeAdd((volatile long *)(p), (v))
+#define atomicFence() MemoryBarrier()
+#define atomicExchange(p, v) InterlockedExchangePointer((PVOID volatile *)(p), (v))
+#define atomicCompareExchange(p, expected, v) (InterlockedCompareExchange((volatile long *)(p), (v), (expected)) == (expected))
+#else
+#define THREAD_LOCAL _Thread_local
+#define atomicFetchAdd(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define atomicFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define atomicExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomicCompareExchange(p, expected, v) __sync_bool_compare_and_swap((p), (expected), (v))
+#endif
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef HANDLE Signal;			// Auto-reset event.
+#else
+typedef pthread_t Thread;
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool raised;
+} SignalState;
+typedef SignalState *Signal;
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/stb_image.h>
 
-// Textures
+// Textures, the level textures are only a fallback for when there is no texture pack.
 #include "textures/T_NUMBERS.h"
+#ifndef NO_BUILTIN_TEXTURES
 #include "textures/T_VIEW2D.h"
 #include "textures/T_00.h"
 #include "textures/T_01.h"
@@ -42,7 +95,7 @@
 #include "textures/T_17.h"
 #include "textures/T_18.h"
 #include "textures/T_19.h"
-int numText = 19;			//number of textures
+#endif
 
 // Macros
 #define BACKGROUND		(RGBA){ 0x00, 0x3C, 0x82, 0xff }
@@ -57,9 +110,12 @@ int numText = 19;			//number of textures
 
 // Constants
 const char *window_name = "Pixel Test";
+const char *level_path = "./res/levels/level";
 
-const unsigned int buffer_width = 160;
-const unsigned int buffer_height = 120;
+const unsigned int base_width = 160;		// Resolution the view and fov are defined at.
+const unsigned int base_height = 120;
+const unsigned int max_width = 1920;
+const unsigned int max_height = 1080;
 const unsigned int buffer_channels = 4;
 
 // Structs
@@ -116,16 +172,491 @@ typedef struct
 	int d;			// For sorting drawing order.
 	int c1, c2;		// Bottom and top colors.
 	int st, ss;		// Surface texture, and the scale.
-	int surf[160];	// Surface points. TODO: Set array count to Buffer Width
 	int surface;	// Surface check.
 } Sector;
 
+#define MAX_MIP_LEVELS 12		// Enough to take a 2048 texel side down to 1.
+#define MAX_TEXTURE_SIZE (1 << (MAX_MIP_LEVELS - 1))
+
 typedef struct
 {
 	int w, h;					// Texture width and height.
 	const unsigned char *name;	// Texture Name.
+	RGBA *texels;				// Converted at load: RGBA, column by column, row 0 at the top, then the mip levels.
+	int texelCount;				// Texels in every level.
+	int mipCount;				// Levels including the full size one, each half the size of the last down to 1x1.
+	int mipOffset[MAX_MIP_LEVELS];	// First texel of each level.
+	RGBA *swizzled;				// Same texels in Z-order for surfaces, NULL until converted.
+	int tileShift;				// log2 of the square Z-order tile side, tiles follow each other along the longer axis.
+	unsigned char *indices;		// Palette indices laid out like texels, built in palettized mode.
 } TextureMap;
 
+#define PACK_NAME_LENGTH 32
+#define PACK_MAX_WORKERS 8
+
+typedef struct
+{
+	char magic[4];					// "PRTP"
+	int version;					// Texture pack format version.
+	int count;						// Followed by count entries, then the encoded images.
+	int reserved;
+} PackHeader;
+
+typedef struct
+{
+	char name[PACK_NAME_LENGTH];	// Image file name without its extension.
+	unsigned int offset;			// Encoded image, from the start of the pack.
+	unsigned int size;
+	int w, h;
+} PackEntry;
+
+typedef struct
+{
+	const unsigned char *pack;
+	const PackEntry *entries;
+	int count;
+	volatile int next;				// Next entry for a worker to decode.
+	const char **failures;			// Why each entry couldn't be decoded, NULL if it was.
+} PackDecodeJob;
+
+// Binary levels: a header, a table of checksummed sections, then the sections, each a packed array of records.
+// Every field is a 32-bit little-endian integer, so on the little-endian machines this builds for the
+// mapped file is read in place.
+typedef struct
+{
+	char magic[4];					// "PRLV"
+	int version;					// Binary level format version.
+	int sectionCount;				// Followed by the section table.
+	unsigned int checksum;			// FNV-1a of the section table.
+} LevelHeader;
+
+typedef struct
+{
+	char id[4];						// "SECT", "WALL", "PLYR", or "CHNK" and "CDAT" for chunked levels. Unknown ids are skipped.
+	unsigned int offset;			// From the start of the file, 4 byte aligned.
+	unsigned int size;				// A whole number of records.
+	unsigned int checksum;			// FNV-1a of the section's bytes.
+} LevelSection;
+
+typedef struct
+{
+	int ws, we, z1, z2, st, ss;		// The text format's sector fields, in the same order.
+} LevelSector;
+
+typedef struct
+{
+	int x1, y1, x2, y2, wt, u, v, shade;
+} LevelWall;
+
+// Chunked levels replace SECT and WALL with a grid of chunks: the grid and a LevelChunk per chunk in CHNK, and every
+// chunk's sectors followed by its walls in CDAT. CDAT is checked chunk by chunk as chunks stream in.
+typedef struct
+{
+	int size;						// World units per side of a chunk.
+	int x, y;						// World position of the first chunk's corner.
+	int columns, rows;				// Followed by a LevelChunk per chunk, row by row.
+} LevelChunkGrid;
+
+typedef struct
+{
+	unsigned int offset;			// From the start of CDAT, 4 byte aligned.
+	unsigned int sectorCount, wallCount;	// Sector walls are numbered from the chunk's first wall.
+	unsigned int checksum;			// FNV-1a of the chunk's records.
+} LevelChunk;
+
+typedef struct
+{
+	unsigned int offset;			// First texel of the level, from the texture's first texel.
+	unsigned char wShift, hShift;	// log2 of the level's width and height.
+	unsigned short wMask, hMask;	// Width and height - 1, to wrap coordinates.
+} TextureLevel;
+
+typedef struct
+{
+	const RGBA *texels;				// Level 0 of the texture, in the atlas or on its own when it is streamed.
+	const unsigned char *indices;	// Palette indices at the same offsets, in palettized mode.
+	int mipCount;
+	TextureLevel levels[MAX_MIP_LEVELS];
+	const RGBA *swizzled;			// Z-order copy of level 0 for surfaces, NULL when there is none.
+	int tileShift;					// log2 of the Z-order tile side.
+} TextureDescriptor;
+
+typedef enum
+{
+	STAGE_TICK,
+	STAGE_DRAW3D,
+	STAGE_WALLS,				// drawWall front pass.
+	STAGE_SURFACES,				// drawWall floor and ceiling pass.
+	STAGE_COMBINE,
+	STAGE_UPLOAD,
+	STAGE_COUNT
+} Stage;
+
+#define PROFILE_HISTORY 64		// Frames kept for the rolling average.
+
+typedef struct
+{
+	double start[STAGE_COUNT];							// Start time of running timers.
+	double current[STAGE_COUNT];						// Milliseconds accumulated this frame.
+	double history[PROFILE_HISTORY][STAGE_COUNT];		// Ring buffer of finished frames.
+	unsigned int frame;									// Next ring buffer slot.
+	unsigned int frameCount;							// Finished frames, capped at PROFILE_HISTORY.
+	unsigned long long pixels[STAGE_COUNT];				// Pixels written since start.
+	bool hud;											// Draw stage timings on screen.
+} Profiler;
+
+typedef enum
+{
+	PASS_CLEAR,
+	PASS_WALLS,
+	PASS_SURFACES,
+	PASS_OVERLAY,				// Spare and HUD layers.
+	PASS_COMPOSITE,
+	PASS_COUNT
+} Pass;
+
+typedef enum
+{
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_L1D_MISSES,
+	COUNTER_LLC_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+} Counter;
+
+typedef struct
+{
+	bool enabled;
+	int fds[COUNTER_COUNT];									// -1 if the counter could not be opened.
+	int slots[COUNTER_COUNT];								// Position of each counter in a group read.
+	int opened;												// Counters in the group.
+	unsigned long long start[STAGE_COUNT][COUNTER_COUNT];	// Values when a stage began.
+	unsigned long long totals[STAGE_COUNT][COUNTER_COUNT];	// Accumulated since the last report.
+	unsigned long long reportPixels[STAGE_COUNT];			// Stage pixel counts at the last report.
+	unsigned int frames;
+} PerfCounters;
+
+typedef struct
+{
+	bool enabled;
+	Pass pass;										// Pass currently writing pixels.
+	int sector;										// Sector currently drawing.
+	unsigned short *counts;							// Scene writes per pixel this frame.
+	unsigned int writes[PASS_COUNT];				// Pixel writes per pass this frame.
+	unsigned int sectorWrites[128];					// Scene writes per sector this frame.
+	unsigned int lastWrites[PASS_COUNT];			// Totals of the last finished frame.
+	unsigned int lastMaxCount;						// Most writes to a single pixel last frame.
+	int lastWorstSector;							// Sector with the most writes last frame.
+	unsigned int lastWorstSectorWrites;
+} Overdraw;
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_MAX_EVENTS (1 << 20)	// Events per thread before recording stops.
+
+typedef struct
+{
+	const char *name;
+	double ts;					// Microseconds since tracing started.
+	int arg;					// Optional argument, -1 for none.
+	char phase;					// 'B'egin, 'E'nd or 'M' for a thread name, which is then the name.
+} TraceEvent;
+
+typedef struct
+{
+	volatile unsigned int count;	// Published after each event is written.
+	unsigned int dropped;
+	TraceEvent *events;
+	volatile long released;			// Its thread exited, the next thread to trace carries on in it.
+} TraceBuffer;
+
+typedef struct
+{
+	bool enabled;
+	const char *path;			// Chrome trace JSON output.
+	double start;
+	volatile long threadCount;
+	TraceBuffer threads[TRACE_MAX_THREADS];
+} Trace;
+
+#define WATCHDOG_MAX_BUNDLES 8	// Bundles written per run.
+
+typedef struct
+{
+	char magic[4];							// "PRSF"
+	int version;							// Bundle format version.
+	int width, height;						// Framebuffer resolution.
+	double frameMs;							// Time the slow frame took.
+	double thresholdMs;						// Budget it exceeded.
+	unsigned int levelHash;					// Hash of the level file.
+	Player player;							// Camera of the slow frame.
+	double stageMs[STAGE_COUNT];			// Stage timings of the slow frame.
+	int visibleSectors, visibleWalls;		// Sectors and walls sent to drawWall.
+	int sectorCount, wallCount;				// Followed by sectors, walls and the composited frame.
+	int hud, overdraw;						// Overlay modes active for the frame.
+	int sceneWidth, sceneHeight;			// 3D resolution of the frame.
+	int dynamicResolution;					// The scene follows the frame as its own image.
+	int palettized;							// The scene was drawn as palette indices.
+	int mipmapping, swizzled;				// Walls and surfaces sampled mip levels, surfaces the Z-order copies.
+	int columnMajor;						// The scene was stored column by column.
+	int lodDistance;						// Column LOD distance the frame was drawn with, 0 for off.
+	double lodBudgetMs;						// Wall budget moving that distance, 0 when fixed.
+	int interlaced;							// Interlacing was on.
+	int interlaceParity;					// Columns the frame drew, 0 even, 1 odd, -1 all. Unless all, the scene
+											// columns kept from the frame before follow the captured scene.
+} BundleHeader;
+
+typedef struct
+{
+	double thresholdMs;						// 0 disables the watchdog.
+	double frameStart;
+	Player player;							// State the frame started rendering from.
+	Sector sectors[128];
+	int sectorCount, wallCount;				// Level size the frame started with.
+	unsigned char *scene;					// Scene the frame started from, interlaced frames keep half of it.
+	unsigned int bundles;					// Bundles written so far.
+} Watchdog;
+
+#define METRICS_BUCKETS 24		// Histogram bucket i counts times in [2^i, 2^(i+1)) microseconds.
+
+typedef struct
+{
+	char magic[4];									// "PRMT"
+	int version;									// Metrics block version.
+	volatile unsigned int sequence;					// Seqlock, odd while the block is being written.
+	int pid;
+	double uptime;									// Seconds since the game loop started.
+	unsigned long long frames;						// Frames rendered since start.
+	unsigned long long ticks;						// Ticks run since start.
+	unsigned long long pixels;						// Scene pixels written since start.
+	double frameMs;									// Time between the last two frames.
+	double renderMs;								// Render time of the last frame.
+	double uploadMs;								// Upload time of the last frame.
+	double fps;										// Frames in the last second.
+	double tickRate;								// Ticks in the last second.
+	unsigned int frameHistogram[METRICS_BUCKETS];	// Time between frames.
+	unsigned int uploadHistogram[METRICS_BUCKETS];	// Upload time.
+} Metrics;
+
+typedef struct
+{
+	double input;				// Key event that changed PlayerInput.
+	double tick;				// Tick that applied it.
+	double render;				// render() finished.
+	double composite;			// combineFramebuffers() finished.
+	double upload;				// Composited frame copied to the GPU, at the start of the next frame.
+	double present;				// glfwSwapBuffers() returned.
+} FrameStamps;
+
+typedef enum
+{
+	LATENCY_WAIT_TICK,
+	LATENCY_RENDER,
+	LATENCY_COMPOSITE,
+	LATENCY_UPLOAD,
+	LATENCY_PRESENT,
+	LATENCY_TOTAL,
+	LATENCY_COUNT
+} LatencySegment;
+
+#define LATENCY_SAMPLES 1024	// Most recent samples kept for percentiles.
+
+typedef struct
+{
+	bool enabled;
+	double pendingInput;						// Earliest input no tick has applied yet.
+	FrameStamps ticked;							// Applied by a tick, waiting to be rendered.
+	FrameStamps rendered;						// Rendered and composited this frame.
+	FrameStamps inFlight;						// Composited last frame, uploaded and presented this frame.
+	double samples[LATENCY_SAMPLES][LATENCY_COUNT];	// Milliseconds per segment.
+	unsigned int sampleCount;					// Samples recorded since start.
+	unsigned int reportedCount;					// Samples at the last report.
+} Latency;
+
+#define TICK_RATE 35			// Game updates per second, demos hold one input per tick.
+
+typedef struct
+{
+	char magic[4];				// "PRDM"
+	int version;				// Demo format version.
+	int tickRate;				// Ticks per second the demo was recorded at.
+	unsigned int levelHash;		// Hash of the level file at record time.
+	Player start;				// Player state on the first tick.
+} DemoHeader;
+
+typedef struct
+{
+	const char *kernel;			// Kernel name.
+	char params[96];			// Kernel parameters, e.g. span and texture.
+	void (*run)(int);			// Runs the kernel n times.
+	double pixels;				// Pixels written per call, 0 if not applicable.
+} Benchmark;
+
+typedef struct
+{
+	FILE *fp;
+	int recording;
+	int playing;
+	int timedemo;				// Play back as fast as possible.
+	unsigned int ticks;			// Ticks recorded or played back.
+} Demo;
+
+#define LOD_MIN_DISTANCE 32		// Closest the budget mode pulls the LOD distance.
+#define LOD_MAX_DISTANCE 4096
+
+typedef struct
+{
+	int distance;				// Walls this far away draw every 2nd column, twice as far every 4th. 0 disables.
+	double budgetMs;			// Move the distance to keep wall drawing under this, 0 keeps it fixed.
+	double wallMs;				// Smoothed wall drawing time per frame.
+	int step;					// Column step of the wall being drawn.
+	int y1, y2;					// Rows of the last sampled column.
+	unsigned int *column;		// Colors of the last sampled column, one per row.
+} ColumnLOD;
+
+typedef struct
+{
+	bool enabled;
+	int maxTurn;				// Degrees the camera may turn between frames before a full refresh.
+	int parity;					// Columns drawn this frame, 0 even, 1 odd, -1 all.
+	unsigned int frame;
+	bool stale;					// Kept columns were drawn from a different camera.
+	Player player;				// Camera of the last frame.
+	unsigned int levelGeneration, sceneWidth, sceneHeight;
+} Interlace;
+
+#define PALETTE_LIGHT_LEVELS 101	// Wall shade / 2, from 0 (full bright) to 100 (black).
+
+typedef struct
+{
+	RGBA colors[256];			// Entry 0 is the background, the rest are shared by every texture.
+	int colorCount;
+	unsigned char colormap[PALETTE_LIGHT_LEVELS][256];	// Nearest entry to each color at each light level.
+} Palette;
+
+#define SHADE_LEVELS 101		// Wall shade / 2, the steps drawWall shades by.
+#define SHADE_CACHE_ENTRIES 256
+
+typedef struct
+{
+	int texture, level;
+	RGBA *texels;				// Shaded copy laid out like the texture's texels, NULL when the entry is free.
+	size_t size;
+	unsigned int lastUsed;
+} ShadedTexture;
+
+typedef struct
+{
+	size_t budget;				// Bytes of shaded texels kept, 0 shades every pixel.
+	size_t used;
+	unsigned int clock;			// Bumped on every lookup, for least recently used eviction.
+	unsigned int hits, misses, evictions;
+	ShadedTexture entries[SHADE_CACHE_ENTRIES];
+	unsigned short (*lookup)[SHADE_LEVELS];	// Entry + 1 for each texture and level, 0 when not cached.
+} ShadeCache;
+
+#define RESIDENCY_PREFETCH 16			// Textures prefetched for a sector, from the sectors next to it.
+#define RESIDENCY_NEIGHBOUR_DISTANCE 32	// Sectors whose bounds are this close count as next to each other.
+
+typedef enum
+{
+	TEXTURE_NOT_RESIDENT,		// Drawn with the placeholder.
+	TEXTURE_QUEUED,				// Waiting for the loader.
+	TEXTURE_READY,				// Decoded by the loader, waiting for the main thread to install it.
+	TEXTURE_RESIDENT
+} TextureState;
+
+typedef struct
+{
+	bool enabled;
+	size_t budget;				// Bytes of texels and Z-order copies kept resident, set with -residency.
+	size_t used;
+	unsigned int frame;
+	volatile int *state;		// TextureState of each texture, the loader only moves QUEUED to READY.
+	unsigned int *lastUsed;		// Frame each texture was last drawn or prefetched in.
+	double *requested;			// When each texture was queued, for load latency.
+	TextureMap *loaded;			// Decoded by the loader, moved into the textures when installed.
+	int *queue;					// Ring of textures to load, written by the main thread and read by the loader.
+	volatile int head, tail;
+	int resident, pending;		// Textures installed, and queued or ready but not installed yet.
+	volatile bool stop;
+	bool started;
+	Thread loader;
+	Signal wake;				// Raised when a texture is queued or the loader should stop.
+	short prefetch[256][RESIDENCY_PREFETCH];	// Textures of neighbouring sectors, -1 terminated, by first wall
+												// since sectors are re-sorted every frame.
+	unsigned int loads, evictions, placeholderDraws;	// Since the last report.
+	double loadMs, maxLoadMs;	// Queued to installed.
+} Residency;
+
+#define CHUNK_MAX_REACH 16		// Chunks, the draw radius and prefetch together.
+#define CHUNK_MAX_CELLS ((2 * CHUNK_MAX_REACH + 1) * (2 * CHUNK_MAX_REACH + 1))
+
+typedef enum
+{
+	CHUNK_UNLOADED,
+	CHUNK_LOADING,				// Being read by the loader, or published and waiting for the main thread.
+	CHUNK_ACTIVE,				// Taken by the main thread, drawn while in the draw radius.
+	CHUNK_FAILED				// Damaged, not retried.
+} ChunkState;
+
+typedef struct
+{
+	unsigned int sectorCount, wallCount;
+	Sector *sectors;			// Walls numbered from the chunk's first wall.
+	Wall *walls;
+	double loadStart;			// When the loader started reading it.
+} Chunk;
+
+typedef struct
+{
+	bool enabled;				// A chunked level is loaded and its loader is running.
+	int radius, prefetch;		// Chunks drawn around the player's, and loaded ahead beyond that.
+	const unsigned char *level;	// Mapped level, chunk records are copied out of it by the loader.
+	size_t levelSize;
+	LevelChunkGrid grid;
+	const LevelChunk *directory;
+	const unsigned char *data;	// CDAT.
+	size_t dataSize;
+	volatile int centerX, centerY;	// Player's chunk, the loader works outwards from it.
+	bool assembled;
+	int drawnX, drawnY;			// Chunk the drawn level was assembled around.
+	Sector *source[256];		// Chunk copy of each drawn sector, by first wall since sectors are re-sorted every frame.
+	volatile int *state;		// ChunkState of each chunk.
+	Chunk *volatile *published;	// Swapped in whole by the loader and out by the main thread.
+	Chunk **active;				// Main thread only.
+	volatile bool stop;
+	Thread loader;
+	Signal wake;				// Raised when the player changes chunk or the loader should stop.
+	int dropped;				// Loaded chunks in the draw radius that didn't fit the sector and wall arrays.
+	int notReady;				// Chunks in the draw radius missing from the last frame.
+	unsigned int loads, unloads, notReadyFrames, maxNotReady;	// Since the last report.
+	double loadMs, maxLoadMs;	// Loader start to the main thread taking the chunk.
+} ChunkStreamer;
+
+#define DYNRES_WINDOW 8			// Frames averaged before each resolution change.
+
+typedef struct
+{
+	bool enabled;
+	double budgetMs;			// Target time for renderFrame().
+	float minScale, maxScale;	// Bounds as a fraction of the buffer resolution.
+	float scale;				// Current fraction.
+	double frameMs[DYNRES_WINDOW];
+	unsigned int frames;
+	unsigned int pboWidth[2];	// Scene resolution held by each pixel buffer.
+	unsigned int pboHeight[2];
+} DynamicResolution;
+
+typedef struct
+{
+	bool enabled;
+	bool rendered;				// A frame has been presented since start.
+	bool layersDirty;			// An overlay layer needs redrawing, e.g. the HUD or a window expose.
+	unsigned int viewHash;		// Camera, level and layer state of the last presented frame.
+	unsigned int skipped;		// Unchanged frames skipped since the last report.
+} RenderOnChange;
+
 // Global Variables
 GLFWwindow *window;
 
@@ -140,24 +671,75 @@ unsigned int vertexShader, fragmentShader, shaderProgram;
 mat4 view, projection;
 
 unsigned int texture;
+unsigned int sceneTexture; // Scene at its own resolution when dynamic resolution is on.
 
+unsigned int buffer_width = 160;	// Set with -width and -height.
+unsigned int buffer_height = 120;
+unsigned int scene_width = 160;		// 3D resolution, below the buffer resolution with dynamic resolution.
+unsigned int scene_height = 120;
 size_t buffer_size;
 size_t fbuffer_count = 4;
 unsigned char *imageBuffer;
-unsigned char *framebuffer[4]; // 0 for 3D stuff, 1 & 2 are spare, 3 is all framebuffers combined.
+unsigned char *framebuffer[4]; // 0 for 3D stuff, 1 is spare, 2 is the HUD, 3 is all framebuffers combined.
 unsigned int activeFramebuffer = 3;
+bool swizzleSurfaces = false; // Sample surfaces from the Z-order texture copies.
+bool mipmapping = false;	// Sample far walls and surfaces from the smaller mip levels.
+bool columnMajor = false;	// Framebuffer 0 is stored column by column, transposed when combined.
+bool palettized = false;	// The scene is drawn as palette indices, expanded when combined.
+unsigned char *sceneIndices; // One palette index per scene pixel in palettized mode, laid out like framebuffer 0.
+unsigned char *sceneRows;	// Row-major RGBA scene in column-major or palettized mode.
+int *surf;					// Surface points per column for the sector being drawn.
+
+double targetFPS = -1; // Maximum renders between frames. -1 Disable render frame cap.
 
-unsigned int scale = 4;
+unsigned int scale = 0; // Window pixels per buffer pixel, 0 picks one for a 640 pixel wide window.
 unsigned int screen_width;
 unsigned int screen_height;
 
-float fov = 200;
+float fov = 200; // At base_width, scaled with the buffer width.
+float viewScale = 1.0f; // scene_width / base_width.
 
 Math math;
 PlayerInput playerInput;
 Player player;
 
-TextureMap textures[64];
+TextureMap *textures;
+TextureDescriptor *textureDescriptors;	// What the kernels sample textures by, a placeholder while a streamed texture loads.
+int textureCount;
+const char *texturePackPath = "./res/textures.pack";
+const unsigned char *texturePack;	// Mapped for as long as the textures are loaded.
+size_t texturePackSize;
+RGBA *textureAtlas;				// Every texture's texels and mip levels, each texture starting on a 64 byte line.
+unsigned char *indexAtlas;		// Palette indices at the same offsets as the atlas, in palettized mode.
+size_t atlasTexels;
+
+Demo demo;
+Profiler profiler;
+Overdraw overdraw;
+PerfCounters perfCounters;
+Trace trace;
+Metrics *metrics = NULL;
+Latency latency;
+const char *latencyNames[LATENCY_COUNT] = { "wait for tick", "render", "composite", "upload", "present", "total" };
+Watchdog watchdog;
+int visibleSectors = 0;
+int visibleWalls = 0;
+THREAD_LOCAL TraceBuffer *traceBuffer = NULL;
+THREAD_LOCAL bool traceUnregistered = false; // Every buffer was taken when this thread first traced, its events are dropped.
+const char *stageNames[STAGE_COUNT] = { "tick", "draw3D", "drawWall", "surfaces", "combineFramebuffers", "upload" };
+bool levelReloadPending = false;
+unsigned int levelHash = 0;
+unsigned int levelGeneration = 0; // Bumped on every level load.
+RenderOnChange renderOnChange;
+DynamicResolution dynamicResolution = { false, 0.0, 0.25f, 1.0f, 1.0f };
+ColumnLOD columnLOD = { 0, 0.0, 0.0, 1 };
+Interlace interlace = { false, 8, -1 };
+Palette palette;
+ShadeCache shadeCache = { 1024 * 1024 };
+Residency residency;
+ChunkStreamer chunks = { false, 1, 1 };
+RGBA placeholderTexel = { 0x80, 0x80, 0x80, 0xff };
+TextureDescriptor placeholderTexture = { &placeholderTexel, NULL, 1 };	// Flat grey, what streamed textures draw as until loaded.
 
 unsigned int sectorCount;
 unsigned int wallCount;
@@ -166,17 +748,54 @@ Sector sectors[128];
 
 // Callbacks
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
+void refreshCallback(GLFWwindow *window);
 
 // Forward Declaration
 void start();
 void shutdown();
 
-void initSharedMemory();
+void initSharedMemory(bool withPalette);
+void freeSharedMemory();
+void setSceneResolution(unsigned int width, unsigned int height);
+void setSceneScale(float scale);
+void updateDynamicResolution();
+void updateColumnLOD();
 
 void runGame();
 void initGame();
+void allocateTextures(int count);
+void loadBuiltinTextures();
+bool loadTexturePack(const char *path);
+void decodeTextures(void *arg);
+const char *decodePackEntry(const unsigned char *pack, const PackEntry *entry, TextureMap *texture);
+bool validTextureSize(int w, int h);
+void missingTexture(TextureMap *texture);
+int bakeTexturePack(const char *directory, const char *path);
+int exportTextures(const char *directory);
+void convertTexture(TextureMap *texture);
+void buildAtlas();
+void describeTexture(TextureDescriptor *descriptor, const TextureMap *texture);
+void *alignedAlloc(size_t size);
+void alignedFree(void *ptr);
+int mipLevel(const TextureDescriptor *descriptor, float step);
+void buildPalette();
+unsigned char nearestColor(int r, int g, int b);
+const RGBA *shadedTexture(int texture, int shade);
+void releaseShadedTextures(int texture);
+bool startResidency();
+void stopResidency();
+void loadQueuedTextures(void *arg);
+void requestTexture(int texture, bool drawn);
+void updateResidency();
+void buildPrefetchLists();
+size_t residentSize(const TextureMap *texture);
+unsigned int mortonIndex(unsigned int u, unsigned int v);
+unsigned int swizzledIndex(const TextureDescriptor *descriptor, unsigned int u, unsigned int v);
 void tick();
 void render();
+void beginInterlacedFrame();
+void renderFrame();
+void presentFrame();
 void cleanupGame();
 
 void initOpenGL();
@@ -184,24 +803,306 @@ void startOpenGLRender();
 void endOpenGLRender();
 void cleanupOpenGL();
 
+void clearScene(const RGBA color);
 void clearBackground(unsigned char *framebuffer, const RGBA color);
 void drawPixel(unsigned char *framebuffer, const int x, const int y, const RGBA color);
+void drawScenePixel(const int x, const int y, const RGBA color);
+void drawSceneIndex(const int x, const int y, const unsigned char index);
+void countOverdraw(const int x, const int y);
 void combineFramebuffers();
+void transposeColumns(unsigned int *dst, const unsigned int *src, int width, int height);
+void expandIndices(unsigned int *dst, const unsigned char *src, int width, int height);
+void copyPixelBuffer(unsigned char *dst, const unsigned char *src, size_t size);
 
 void loadScene();
+void prepareLevel();
+bool readTextLevel(const char *path);
+bool parseTextLevel(const char *path, LevelSector **levelSectors, unsigned int *levelSectorCount, LevelWall **levelWalls, unsigned int *levelWallCount, Player *start);
+void setLevel(const LevelSector *levelSectors, unsigned int levelSectorCount, const LevelWall *levelWalls, unsigned int levelWallCount, const Player *start);
+Sector sectorFromRecord(const LevelSector *record);
+Wall wallFromRecord(const LevelWall *record);
+bool readBinaryLevel(const unsigned char *data, size_t size, const char *path);
+bool writeBinaryLevel(const char *path, const LevelSector *levelSectors, unsigned int levelSectorCount, const LevelWall *levelWalls, unsigned int levelWallCount, const Player *start, int chunkSize);
+int convertLevel(const char *textPath, const char *binaryPath, int chunkSize);
+bool startChunkStreaming(const unsigned char *level, size_t size, const LevelChunkGrid *grid, const unsigned char *data, size_t dataSize, const Player *start);
+void stopChunkStreaming();
+void releaseChunks(ChunkStreamer *streamer);
+void loadChunks(void *arg);
+Chunk *readChunk(int index);
+void freeChunk(Chunk *chunk);
+void updateChunks();
+void assembleChunks(int centerX, int centerY);
+int chunksInReach(int centerX, int centerY, int reach, int *cells);
+void chunkPosition(int x, int y, int *chunkX, int *chunkY);
+unsigned int hashLevelFile(const char *path);
+unsigned int levelFileHash(const unsigned char *data, size_t size);
+unsigned int hashBytes(const void *data, size_t size);
+unsigned char *readFile(const char *path, size_t *size);
+char **listDirectory(const char *directory, int *count);
+const unsigned char *mapFile(const char *path, size_t *size);
+void unmapFile(const unsigned char *data, size_t size);
+
+bool startThread(Thread *thread, void (*run)(void *), void *arg);
+void joinThread(Thread thread);
+bool createSignal(Signal *signal);
+void destroySignal(Signal signal);
+void raiseSignal(Signal signal);
+void waitSignal(Signal signal);
+int cpuCount();
+
+bool startRecording(const char *path);
+bool startPlayback(const char *path, bool timedemo);
+void stopDemo();
+void recordDemoTick();
+void playDemoTick();
+
+bool viewChanged();
+
 void draw3D();
 void drawWall(int x1, int x2, int b1, int b2, int t1, int t2, int s, int w, int frontBack);
 void clipBehindPlayer(int *x1, int *y1, int *z1, int x2, int y2, int z2);
 int distance(int x1, int y1, int x2, int y2);
 
+double getTime();
+
+void profileBegin(Stage stage);
+void profileEnd(Stage stage);
+void profileTimerBegin(Stage stage);
+void profileTimerEnd(Stage stage);
+void profileCounters(Stage from, Stage to);
+void profileEndFrame();
+void drawProfilerHUD(unsigned char *framebuffer);
+int drawDigit(unsigned char *framebuffer, int x, int y, int digit, const RGBA color);
+int drawNumber(unsigned char *framebuffer, int x, int y, double value, const RGBA color);
+
+void startTrace(const char *path);
+void traceEvent(const char *name, int arg, char phase);
+void traceBegin(const char *name, int arg);
+void traceEnd(const char *name);
+void traceThreadName(const char *name);
+void traceThreadExit();
+void writeTrace();
+void stopTrace();
+
+bool startPerfCounters();
+void readPerfCounters(unsigned long long *values);
+void printPerfCounters();
+void stopPerfCounters();
+
+bool openMetrics(const char *name, bool create);
+void closeMetrics(const char *name, bool created);
+void publishFrameMetrics(double frameMs, double renderMs);
+void publishSecondMetrics(double uptime, int fps, int tickRate);
+int readMetrics(const char *name, bool once);
+void sleepSeconds(double seconds);
+void waitFor(double seconds);
+
+void latencyPresent();
+void printLatency(bool all);
+
+void watchdogBeginFrame();
+size_t keptSceneSize();
+void watchdogEndFrame();
+bool writeBundle(const char *path, double frameMs);
+int rerenderBundle(const char *path, const char *outputPath);
+bool writePPM(const char *path, const unsigned char *framebuffer);
+
+void overdrawBeginFrame();
+void drawOverdrawHeatmap(unsigned char *framebuffer);
+void printOverdraw();
+
+int runBenchmarks(const char *outputPath);
+int compareDouble(const void *a, const void *b);
+void runBenchmark(Benchmark *bench, FILE *out);
+
 // Entry Point
 int main(int argc, char *argv[])
 {
+	// Parse Arguments.
+	const char *recordPath = NULL;
+	const char *playbackPath = NULL;
+	const char *benchPath = NULL;
+	const char *tracePath = NULL;
+	const char *rerenderPath = NULL;
+	const char *rerenderOutput = NULL;
+	const char *metricsName = NULL;
+	const char *readMetricsName = NULL;
+	const char *bakeDirectory = NULL;
+	const char *bakePath = NULL;
+	const char *exportDirectory = NULL;
+	const char *convertTextPath = NULL;
+	const char *convertBinaryPath = NULL;
+	int convertChunkSize = 0;
+	bool readMetricsOnce = false;
+	bool timedemo = false;
+	bool bench = false;
+	bool counters = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-bench") == 0)
+		{
+			bench = true;
+			if (i+1 < argc && argv[i+1][0] != '-')
+				benchPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-metrics") == 0)
+			metricsName = (i+1 < argc && argv[i+1][0] != '-') ? argv[++i] : "pixelrenderer";
+		else if (strcmp(argv[i], "-readmetrics") == 0 || strcmp(argv[i], "-dumpmetrics") == 0)
+		{
+			readMetricsOnce = strcmp(argv[i], "-dumpmetrics") == 0;
+			readMetricsName = (i+1 < argc && argv[i+1][0] != '-') ? argv[++i] : "pixelrenderer";
+		}
+		else if (strcmp(argv[i], "-slowframe") == 0 && i+1 < argc)
+			watchdog.thresholdMs = atof(argv[++i]);
+		else if (strcmp(argv[i], "-rerender") == 0 && i+1 < argc)
+		{
+			rerenderPath = argv[++i];
+			if (i+1 < argc && argv[i+1][0] != '-')
+				rerenderOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "-textures") == 0 && i+1 < argc)
+			texturePackPath = argv[++i];
+		else if (strcmp(argv[i], "-bakepack") == 0 && i+2 < argc)
+		{
+			bakeDirectory = argv[++i];
+			bakePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "-exporttextures") == 0 && i+1 < argc)
+			exportDirectory = argv[++i];
+		else if (strcmp(argv[i], "-level") == 0 && i+1 < argc)
+			level_path = argv[++i];
+		else if (strcmp(argv[i], "-convertlevel") == 0 && i+2 < argc)
+		{
+			convertTextPath = argv[++i];
+			convertBinaryPath = argv[++i];
+			if (i+1 < argc && argv[i+1][0] != '-')
+				convertChunkSize = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-chunkradius") == 0 && i+1 < argc)
+			chunks.radius = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-chunkprefetch") == 0 && i+1 < argc)
+			chunks.prefetch = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-fps") == 0 && i+1 < argc)
+			targetFPS = atof(argv[++i]);
+		else if (strcmp(argv[i], "-width") == 0 && i+1 < argc)
+			buffer_width = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-height") == 0 && i+1 < argc)
+			buffer_height = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-scale") == 0 && i+1 < argc)
+			scale = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-columnmajor") == 0)
+			columnMajor = true;
+		else if (strcmp(argv[i], "-swizzle") == 0)
+			swizzleSurfaces = true;
+		else if (strcmp(argv[i], "-palette") == 0)
+			palettized = true;
+		else if (strcmp(argv[i], "-mipmap") == 0)
+			mipmapping = true;
+		else if (strcmp(argv[i], "-shadecache") == 0 && i+1 < argc)
+			shadeCache.budget = (size_t)atoi(argv[++i]) * 1024;
+		else if (strcmp(argv[i], "-residency") == 0 && i+1 < argc)
+			residency.budget = (size_t)atoi(argv[++i]) * 1024;
+		else if (strcmp(argv[i], "-interlace") == 0)
+		{
+			interlace.enabled = true;
+			if (i+1 < argc && argv[i+1][0] != '-')
+				interlace.maxTurn = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-lod") == 0 && i+1 < argc)
+			columnLOD.distance = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-lodbudget") == 0 && i+1 < argc)
+		{
+			columnLOD.budgetMs = atof(argv[++i]);
+			columnLOD.distance = LOD_MAX_DISTANCE;
+		}
+		else if (strcmp(argv[i], "-dynres") == 0 && i+1 < argc)
+		{
+			dynamicResolution.enabled = true;
+			dynamicResolution.budgetMs = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-dynresbounds") == 0 && i+2 < argc)
+		{
+			dynamicResolution.minScale = atof(argv[++i]);
+			dynamicResolution.maxScale = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-renderonchange") == 0)
+			renderOnChange.enabled = true;
+		else if (strcmp(argv[i], "-latency") == 0)
+			latency.enabled = true;
+		else if (strcmp(argv[i], "-perfcounters") == 0)
+			counters = true;
+		else if (strcmp(argv[i], "-trace") == 0 && i+1 < argc)
+			tracePath = argv[++i];
+		else if (strcmp(argv[i], "-record") == 0 && i+1 < argc)
+			recordPath = argv[++i];
+		else if (strcmp(argv[i], "-playdemo") == 0 && i+1 < argc)
+			playbackPath = argv[++i];
+		else if (strcmp(argv[i], "-timedemo") == 0 && i+1 < argc)
+		{
+			playbackPath = argv[++i];
+			timedemo = true;
+		}
+		else
+			printf("Unknown argument: %s\n", argv[i]);
+	}
+
+	if (buffer_width < 64 || buffer_width > max_width || buffer_height < 48 || buffer_height > max_height)
+	{
+		printf("Resolution must be between 64x48 and %ux%u.\n", max_width, max_height);
+		return 1;
+	}
+	if (dynamicResolution.minScale <= 0.0f || dynamicResolution.maxScale > 1.0f || dynamicResolution.minScale > dynamicResolution.maxScale)
+	{
+		printf("Dynamic resolution bounds must satisfy 0 < min <= max <= 1.\n");
+		return 1;
+	}
+	if (chunks.radius < 0 || chunks.prefetch < 0 || chunks.radius + chunks.prefetch > CHUNK_MAX_REACH)
+	{
+		printf("Chunk radius and prefetch must be at least 0 and add up to at most %i.\n", CHUNK_MAX_REACH);
+		return 1;
+	}
+	dynamicResolution.scale = dynamicResolution.maxScale;
+	if (scale == 0)
+		scale = buffer_width < 640 ? 640 / buffer_width : 1;
 	screen_width = buffer_width * scale;
 	screen_height = buffer_height * scale;
 
+	if (bench)
+		return runBenchmarks(benchPath);
+	if (rerenderPath)
+		return rerenderBundle(rerenderPath, rerenderOutput);
+	if (bakeDirectory)
+		return bakeTexturePack(bakeDirectory, bakePath);
+	if (exportDirectory)
+		return exportTextures(exportDirectory);
+	if (convertTextPath)
+		return convertLevel(convertTextPath, convertBinaryPath, convertChunkSize);
+	if (readMetricsName)
+		return readMetrics(readMetricsName, readMetricsOnce);
+
+	// Streaming only runs in the game, headless modes need every texture up front.
+	residency.enabled = residency.budget > 0 && !palettized;
+	if (residency.budget > 0 && palettized)
+		printf("Texture residency is off in palettized mode, the palette is built from every texture.\n");
+	initGame();
+	if (playbackPath && !startPlayback(playbackPath, timedemo))
+		return 1;
+	if (recordPath && !playbackPath && !startRecording(recordPath))
+		return 1;
+	if (tracePath)
+		startTrace(tracePath);
+	if (counters)
+		startPerfCounters();
+	if (metricsName && !openMetrics(metricsName, true))
+		return 1;
+
 	start();
 	shutdown();
+	if (latency.enabled)
+		printLatency(true);
+	closeMetrics(metricsName, true);
+	stopTrace();
+	stopPerfCounters();
 
 	return 0;
 }
@@ -209,7 +1110,7 @@ int main(int argc, char *argv[])
 // Function Definitions
 void start()
 {
-	initSharedMemory();
+	initSharedMemory(palettized);
 	initOpenGL();
 	runGame();
 }
@@ -218,16 +1119,113 @@ void shutdown()
 	cleanupOpenGL();
 }
 
-void initSharedMemory()
+void initSharedMemory(bool withPalette)
 {
 	buffer_size = buffer_width * buffer_height * buffer_channels;
+	setSceneScale(dynamicResolution.enabled ? dynamicResolution.scale : 1.0f);
 
-	// Create Image Buffer.
-	imageBuffer = (unsigned char *)calloc(buffer_size, sizeof(unsigned char));
+	// Create Image Buffer, with room for the scene after the overlays when it is uploaded separately.
+	imageBuffer = (unsigned char *)calloc(dynamicResolution.enabled ? buffer_size * 2 : buffer_size, sizeof(unsigned char));
 
 	// Create Frame Buffers.
 	for (int i = 0; i < fbuffer_count; ++i)
 		framebuffer[i] = (unsigned char *)calloc(buffer_size, sizeof(unsigned char));
+
+	// Create Overdraw Counters.
+	overdraw.counts = (unsigned short *)calloc(buffer_width * buffer_height, sizeof(unsigned short));
+
+	// Create Per-Column Scratch.
+	surf = (int *)calloc(buffer_width, sizeof(int));
+	columnLOD.column = (unsigned int *)calloc(buffer_height, sizeof(unsigned int));
+	if (columnMajor || withPalette)
+		sceneRows = (unsigned char *)calloc(buffer_size, sizeof(unsigned char));
+	if (withPalette)
+		sceneIndices = (unsigned char *)calloc(buffer_width * buffer_height, sizeof(unsigned char));
+	if (interlace.enabled && watchdog.thresholdMs > 0)
+		watchdog.scene = (unsigned char *)calloc(buffer_size, sizeof(unsigned char));
+}
+void freeSharedMemory()
+{
+	for (int i = 0; i < fbuffer_count; ++i)
+	{
+		free(framebuffer[i]);
+		framebuffer[i] = 0;
+	}
+
+	free(imageBuffer);
+	imageBuffer = 0;
+
+	free(overdraw.counts);
+	overdraw.counts = 0;
+
+	free(surf);
+	surf = 0;
+
+	free(columnLOD.column);
+	columnLOD.column = 0;
+
+	free(sceneRows);
+	sceneRows = 0;
+
+	free(sceneIndices);
+	sceneIndices = 0;
+
+	free(watchdog.scene);
+	watchdog.scene = 0;
+}
+void updateColumnLOD()
+{
+	// Smooth the last frame's wall time, then nudge the distance towards the budget.
+	double wallMs = profiler.history[(profiler.frame + PROFILE_HISTORY - 1) % PROFILE_HISTORY][STAGE_WALLS];
+	columnLOD.wallMs += (wallMs - columnLOD.wallMs) * 0.1;
+
+	if (columnLOD.wallMs > columnLOD.budgetMs)
+		columnLOD.distance = columnLOD.distance * 15 / 16;
+	else if (columnLOD.wallMs < columnLOD.budgetMs * 0.75)
+		columnLOD.distance = columnLOD.distance * 17 / 16 + 1;
+
+	if (columnLOD.distance < LOD_MIN_DISTANCE) { columnLOD.distance = LOD_MIN_DISTANCE; }
+	if (columnLOD.distance > LOD_MAX_DISTANCE) { columnLOD.distance = LOD_MAX_DISTANCE; }
+}
+void setSceneResolution(unsigned int width, unsigned int height)
+{
+	scene_width = width;
+	scene_height = height;
+	viewScale = (float)scene_width / base_width;
+}
+void setSceneScale(float scale)
+{
+	// Keep widths a multiple of 4 for the transpose and the aspect ratio of the buffer.
+	unsigned int width = scale >= 1.0f ? buffer_width : ((unsigned int)(buffer_width * scale) & ~3u);
+	if (width < 16) { width = 16; }
+	unsigned int height = (width * buffer_height + buffer_width / 2) / buffer_width;
+	setSceneResolution(width, height);
+}
+void updateDynamicResolution()
+{
+	// Runs once per window of frames, between uploading the last scene and rendering the next.
+	if (dynamicResolution.frames == 0 || dynamicResolution.frames % DYNRES_WINDOW != 0)
+		return;
+
+	double average = 0.0;
+	for (int i = 0; i < DYNRES_WINDOW; ++i)
+		average += dynamicResolution.frameMs[i];
+	average /= DYNRES_WINDOW;
+
+	// Leave some headroom before scaling up so it does not oscillate around the budget.
+	if (average <= dynamicResolution.budgetMs && average >= dynamicResolution.budgetMs * 0.75)
+		return;
+
+	// Cost follows the pixel count, so scale each axis by the square root of the ratio, aiming at 90% of the budget.
+	float ratio = sqrt(dynamicResolution.budgetMs * 0.9 / (average > 0.001 ? average : 0.001));
+	if (ratio < 0.8f) { ratio = 0.8f; }
+	if (ratio > 1.1f) { ratio = 1.1f; }
+
+	float scale = dynamicResolution.scale * ratio;
+	if (scale < dynamicResolution.minScale) { scale = dynamicResolution.minScale; }
+	if (scale > dynamicResolution.maxScale) { scale = dynamicResolution.maxScale; }
+	dynamicResolution.scale = scale;
+	setSceneScale(scale);
 }
 
 void initOpenGL()
@@ -250,9 +1248,14 @@ void initOpenGL()
 		"out vec4 fragColor;\n"
 		"in vec2 texCoord;\n"
 		"uniform sampler2D texture1;\n"
+		"uniform sampler2D texture2;\n"
+		"uniform bool splitScene;\n"
+		"uniform vec2 sceneScale;\n"
 		"void main()\n"
 		"{\n"
 		"	vec4 color = texture(texture1, texCoord);\n"
+		"	if (splitScene && color.a == 0.0)\n"
+		"		color = texture(texture2, texCoord * sceneScale);\n"
 		"	fragColor = color;\n"
 		"}\n";
 
@@ -294,6 +1297,7 @@ void initOpenGL()
 
 	// Setup Callbacks.
 	glfwSetKeyCallback(window, keyCallback);
+	glfwSetWindowRefreshCallback(window, refreshCallback);
 
 	// Initialize OpenGL Scene.
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
@@ -360,12 +1364,23 @@ void initOpenGL()
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	// Create Scene Texture, only the top left scene_width x scene_height is used.
+	glGenTextures(1, &sceneTexture);
+	glBindTexture(GL_TEXTURE_2D, sceneTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, buffer_width, buffer_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
 	// Create Pixel Buffers.
+	size_t pboSize = dynamicResolution.enabled ? buffer_size * 2 : buffer_size;
 	glGenBuffers(2, PBO);
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO[0]);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, 0, GL_STREAM_DRAW);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, pboSize, 0, GL_STREAM_DRAW);
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO[1]);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, 0, GL_STREAM_DRAW);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, pboSize, 0, GL_STREAM_DRAW);
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
 	// Setup Perspective Matrices.
@@ -377,14 +1392,27 @@ void initOpenGL()
 	// Set Shader Uniforms.
 	glUseProgram(shaderProgram);
 	glUniform1i(glGetUniformLocation(shaderProgram, "texture1"), 0);
+	glUniform1i(glGetUniformLocation(shaderProgram, "texture2"), 1);
+	glUniform1i(glGetUniformLocation(shaderProgram, "splitScene"), dynamicResolution.enabled);
 
 	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, view);
 	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, projection);
 }
 void startOpenGLRender()
 {
+	profileBegin(STAGE_UPLOAD);
+
 	// Copy active framebuffer to image buffer.
 	memcpy(imageBuffer, framebuffer[activeFramebuffer], buffer_size);
+	size_t uploadSize = buffer_size;
+
+	// Scene follows the overlays at its own resolution.
+	if (dynamicResolution.enabled)
+	{
+		size_t sceneSize = scene_width * scene_height * buffer_channels;
+		memcpy(imageBuffer + buffer_size, sceneRows ? sceneRows : framebuffer[0], sceneSize);
+		uploadSize += sceneSize;
+	}
 
 	// Get Dual Pixel Buffer index.
 	static int index = 0;
@@ -403,23 +1431,39 @@ void startOpenGLRender()
 	else if (buffer_channels == 4)
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer_width, buffer_height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 
+	if (dynamicResolution.enabled && dynamicResolution.pboWidth[index] > 0)
+	{
+		unsigned int width = dynamicResolution.pboWidth[index];
+		unsigned int height = dynamicResolution.pboHeight[index];
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, sceneTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void *)buffer_size);
+		glUniform2f(glGetUniformLocation(shaderProgram, "sceneScale"), (float)width / buffer_width, (float)height / buffer_height);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
 	// Copy Image Buffer to Pixel Buffer.
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PBO[nextIndex]);
-	glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, 0, GL_STREAM_DRAW);
+	traceBegin("glMapBuffer", -1);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, dynamicResolution.enabled ? buffer_size * 2 : buffer_size, 0, GL_STREAM_DRAW);
 	unsigned char *dst = (unsigned char *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	traceEnd("glMapBuffer");
 	if (dst)
 	{
-		unsigned char *ptr = (unsigned char *)dst;
-		for (size_t i = 0; i < buffer_size; ++i)
-		{
-			*ptr = imageBuffer[i];
-			++ptr;
-		}
+		traceBegin("copyPixelBuffer", -1);
+		copyPixelBuffer(dst, imageBuffer, uploadSize);
+		traceEnd("copyPixelBuffer");
+		dynamicResolution.pboWidth[nextIndex] = scene_width;
+		dynamicResolution.pboHeight[nextIndex] = scene_height;
 
+		traceBegin("glUnmapBuffer", -1);
 		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		traceEnd("glUnmapBuffer");
 	}
 
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	profileEnd(STAGE_UPLOAD);
 }
 void endOpenGLRender()
 {
@@ -437,16 +1481,10 @@ void endOpenGLRender()
 void cleanupOpenGL()
 {
 	// Destroy.
-	for (int i = 0; i < fbuffer_count; ++i)
-	{
-		free(framebuffer[i]);
-		framebuffer[i] = 0;
-	}
-
-	free(imageBuffer);
-	imageBuffer = 0;
+	freeSharedMemory();
 
 	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &sceneTexture);
 	glDeleteBuffers(2, PBO);
 
 	glDeleteVertexArrays(1, &VAO);
@@ -460,13 +1498,18 @@ void cleanupOpenGL()
 
 void runGame()
 {
-	initGame();
-
 	// Game Loop.
-	const double targetFPS = -1; // Maximum renders between frames. -1 Disable render frame cap.
-	const double targetTicks = 35.0; // Maximum updates between frames. default: 35
+	const double targetTicks = TICK_RATE; // Maximum updates between frames.
 	double timeBetweenFrames = 1.0f / targetTicks;
 
+	// Snap the render interval to a whole number of renders per tick, or ticks per render,
+	// so render deadlines land on tick boundaries.
+	double timeBetweenRenders = 0.0;
+	if (targetFPS >= targetTicks)
+		timeBetweenRenders = timeBetweenFrames / floor(targetFPS / targetTicks + 0.5);
+	else if (targetFPS > 0)
+		timeBetweenRenders = timeBetweenFrames * floor(targetTicks / targetFPS + 0.5);
+
 	double now = 0.0;
 	double lastTime = glfwGetTime();
 	double deltaTime = 0.0;
@@ -475,6 +1518,11 @@ void runGame()
 	int ticks = 0;
 	int frames = 0;
 
+	double startTime = lastTime;
+	unsigned int timedemoFrames = 0;
+	double lastFrame = lastTime;
+	double nextRender = lastTime;
+
 	bool shouldRender = false;
 	while (!glfwWindowShouldClose(window))
 	{
@@ -482,50 +1530,135 @@ void runGame()
 		deltaTime += (now - lastTime) / timeBetweenFrames;
 		lastTime = now;
 
-		if (targetFPS == -1)
-			shouldRender = true;
-		else
-			shouldRender = false;
+		if (demo.timedemo) // Run one tick per frame, ignoring the clock.
+		{
+			if (!demo.playing)
+			{
+				double elapsed = now - startTime;
+				printf("timedemo: %u ticks, %u frames in %.3f seconds (%.1f fps, %.3f ms/frame)\n",
+					demo.ticks, timedemoFrames, elapsed, timedemoFrames / elapsed, elapsed * 1000.0 / timedemoFrames);
+				break;
+			}
+
+			tick();
+			renderFrame();
+			timedemoFrames++;
+
+			presentFrame();
+			glfwPollEvents();
+			continue;
+		}
 
 		while (deltaTime >= 1.0)
 		{
 			tick();
 			ticks++;
-			shouldRender = true;
 
 			deltaTime -= 1.0;
 		}
 
-		if (targetFPS != -1)
+		if (targetFPS == -1)
+			shouldRender = true;
+		else
 		{
-			double timeToSleep = (1 - deltaTime) * 1000.0 / targetTicks;
-			#ifdef _WIN32
-			Sleep(timeToSleep);
-			#endif
+			shouldRender = now >= nextRender;
+			if (shouldRender)
+			{
+				nextRender += timeBetweenRenders;
+				if (nextRender <= now) // Fell behind, skip to the next deadline.
+					nextRender += ceil((now - nextRender) / timeBetweenRenders) * timeBetweenRenders;
+			}
+		}
+
+		// Keep showing the last frame when nothing on screen would change.
+		if (shouldRender && renderOnChange.enabled && !viewChanged())
+		{
+			shouldRender = false;
+			renderOnChange.skipped++;
 		}
 
+		// Only present when there is a new frame.
 		if (shouldRender)
 		{
-			startOpenGLRender();
-			render();
-			combineFramebuffers();
-			endOpenGLRender();
+			double frameStart = glfwGetTime();
+			renderFrame();
 			frames++;
+
+			if (metrics)
+				publishFrameMetrics((frameStart - lastFrame) * 1000.0, (glfwGetTime() - frameStart) * 1000.0);
+			lastFrame = frameStart;
+
+			presentFrame();
 		}
 
 		if (glfwGetTime() - timer > 1.0)
 		{
 			timer += 1.0;
 
-			printf("%i ticks, %i fps\n", ticks, frames);
+			if (metrics)
+				publishSecondMetrics(timer - startTime, frames, ticks);
+			else
+			{
+				printf("%i ticks, %i fps", ticks, frames);
+				if (renderOnChange.enabled)
+					printf(", %u unchanged", renderOnChange.skipped);
+				if (dynamicResolution.enabled)
+					printf(", scene %ux%u", scene_width, scene_height);
+				if (columnLOD.distance > 0)
+					printf(", lod distance %i", columnLOD.distance);
+				if (shadeCache.evictions > 0)
+					printf(", %u shade cache evictions", shadeCache.evictions);
+				if (residency.enabled)
+				{
+					printf(", %i/%i textures resident in %zu KB, %u loaded", residency.resident, textureCount, residency.used / 1024, residency.loads);
+					if (residency.loads > 0)
+						printf(" (%.1f ms avg, %.1f ms max)", residency.loadMs / residency.loads, residency.maxLoadMs);
+					printf(", %u evicted, %u placeholder draws", residency.evictions, residency.placeholderDraws);
+				}
+				if (chunks.enabled)
+				{
+					printf(", %u chunks loaded", chunks.loads);
+					if (chunks.loads > 0)
+						printf(" (%.1f ms avg, %.1f ms max)", chunks.loadMs / chunks.loads, chunks.maxLoadMs);
+					printf(", %u unloaded, %u frames with chunks not ready (%u max)", chunks.unloads, chunks.notReadyFrames, chunks.maxNotReady);
+				}
+				printf("\n");
+				shadeCache.evictions = 0;
+				residency.loads = residency.evictions = residency.placeholderDraws = 0;
+				residency.loadMs = residency.maxLoadMs = 0.0;
+				chunks.loads = chunks.unloads = chunks.notReadyFrames = chunks.maxNotReady = 0;
+				chunks.loadMs = chunks.maxLoadMs = 0.0;
+			}
+			if (overdraw.enabled)
+				printOverdraw();
+			if (perfCounters.enabled)
+				printPerfCounters();
+			if (latency.enabled)
+				printLatency(false);
 
 			ticks = 0;
 			frames = 0;
+			renderOnChange.skipped = 0;
 		}
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-	}
+		double current = glfwGetTime();
+		double untilTick = (1.0 - deltaTime) * timeBetweenFrames - (current - lastTime);
+		if (renderOnChange.enabled && !shouldRender && untilTick > 0.0)
+		{
+			// Nothing to draw, only input or the next tick can change the view.
+			glfwWaitEventsTimeout(untilTick);
+			continue;
+		}
+
+		glfwPollEvents();
+
+		// Wait for the next tick or render deadline, whichever comes first.
+		if (targetFPS != -1)
+		{
+			double untilRender = nextRender - current;
+			waitFor(untilTick < untilRender ? untilTick : untilRender);
+		}
+	}
 
 	cleanupGame();
 }
@@ -539,7 +1672,39 @@ void initGame()
 		math.sin[i] = sin(i/180.0*M_PI);
 	}
 
-	// Setup Textures.
+	// Setup Textures, from the texture pack when there is one.
+	if (!loadTexturePack(texturePackPath))
+	{
+		residency.enabled = false;
+#ifdef NO_BUILTIN_TEXTURES
+		allocateTextures(1);
+		missingTexture(&textures[0]);
+#else
+		loadBuiltinTextures();
+#endif
+	}
+	buildAtlas();
+	if (palettized)
+		buildPalette();
+
+	// Setup Player.
+	player.x = 70;
+	player.y = -110;
+	player.z = 20;
+	player.angle = 0;
+	player.look = 0;
+}
+void allocateTextures(int count)
+{
+	textureCount = count;
+	textures = (TextureMap *)calloc(count, sizeof(TextureMap));
+	textureDescriptors = (TextureDescriptor *)calloc(count, sizeof(TextureDescriptor));
+	shadeCache.lookup = calloc(count, sizeof(*shadeCache.lookup));
+}
+#ifndef NO_BUILTIN_TEXTURES
+void loadBuiltinTextures()
+{
+	allocateTextures(20);
 	textures[0].name = T_00; textures[0].h = T_00_HEIGHT; textures[0].w = T_00_WIDTH;
 	textures[1].name = T_01; textures[1].h = T_01_HEIGHT; textures[1].w = T_01_WIDTH;
 	textures[2].name = T_02; textures[2].h = T_02_HEIGHT; textures[2].w = T_02_WIDTH;
@@ -560,188 +1725,2184 @@ void initGame()
 	textures[17].name = T_17; textures[17].h = T_17_HEIGHT; textures[17].w = T_17_WIDTH;
 	textures[18].name = T_18; textures[18].h = T_18_HEIGHT; textures[18].w = T_18_WIDTH;
 	textures[19].name = T_19; textures[19].h = T_19_HEIGHT; textures[19].w = T_19_WIDTH;
-
-	// Setup Player.
-	player.x = 70;
-	player.y = -110;
-	player.z = 20;
-	player.angle = 0;
-	player.look = 0;
+	for (int i = 0; i < textureCount; ++i)
+		convertTexture(&textures[i]);
 }
-void cleanupGame()
+#endif
+bool loadTexturePack(const char *path)
 {
+	// Texture i is the pack's entry i, decoded and converted on worker threads straight from the mapping,
+	// or by the loader thread when it is first needed with texture residency on.
+	size_t size;
+	const unsigned char *pack = mapFile(path, &size);
+	if (pack == NULL)
+		return false;
+
+	const PackHeader *header = (const PackHeader *)pack;
+	const PackEntry *entries = (const PackEntry *)(pack + sizeof(PackHeader));
+	bool valid = size >= sizeof(PackHeader) && memcmp(header->magic, "PRTP", 4) == 0 && header->version == 1 &&
+		header->count > 0 && header->count <= (size - sizeof(PackHeader)) / sizeof(PackEntry);
+	for (int i = 0; valid && i < header->count; ++i)
+		valid = entries[i].offset <= size && entries[i].size <= size - entries[i].offset;
+	if (!valid)
+	{
+		printf("%s is not a valid texture pack.\n", path);
+		unmapFile(pack, size);
+		return false;
+	}
+
+	double startTime = getTime();
+	allocateTextures(header->count);
+	texturePack = pack;
+	texturePackSize = size;
+	stbi_set_flip_vertically_on_load(1); // Bottom-up rows, like the compiled-in textures.
+	if (residency.enabled)
+	{
+		for (int i = 0; i < textureCount; ++i)
+		{
+			// Sized as convertTexture will resample them, entries that won't decode load as the 16x16 missing texture.
+			bool valid = validTextureSize(entries[i].w, entries[i].h);
+			textures[i].w = valid ? entries[i].w : 16;
+			textures[i].h = valid ? entries[i].h : 16;
+			while (textures[i].w & (textures[i].w - 1)) { textures[i].w += textures[i].w & -textures[i].w; }
+			while (textures[i].h & (textures[i].h - 1)) { textures[i].h += textures[i].h & -textures[i].h; }
+		}
+		if (startResidency())
+		{
+			printf("Streaming %i textures from %s within %zu KB.\n", textureCount, path, residency.budget / 1024);
+			return true;
+		}
+		printf("Texture loader thread could not be started, loading every texture.\n");
+		residency.enabled = false;
+	}
+
+	PackDecodeJob job = { pack, entries, header->count, 0 };
+	job.failures = (const char **)calloc(job.count, sizeof(const char *));
+	int workers = cpuCount();
+	if (workers > job.count) { workers = job.count; }
+	if (workers > PACK_MAX_WORKERS) { workers = PACK_MAX_WORKERS; }
+
+	Thread threads[PACK_MAX_WORKERS];
+	int started = 0;
+	while (started < workers - 1 && startThread(&threads[started], decodeTextures, &job))
+		started++;
+	decodeTextures(&job);
+	for (int i = 0; i < started; ++i)
+		joinThread(threads[i]);
+
+	for (int i = 0; i < textureCount; ++i)
+	{
+		if (textures[i].texels)
+			continue;
+		printf("Texture %.*s in %s could not be decoded: %s\n", PACK_NAME_LENGTH, entries[i].name, path, job.failures[i]);
+		missingTexture(&textures[i]);
+	}
+	free(job.failures);
 
+	printf("Loaded %i textures from %s in %.1f ms on %i thread%s.\n", textureCount, path, (getTime() - startTime) * 1000.0, started + 1, started > 0 ? "s" : "");
+	return true;
 }
+void decodeTextures(void *arg)
+{
+	PackDecodeJob *job = (PackDecodeJob *)arg;
+	for (;;)
+	{
+		int i = atomicFetchAdd(&job->next, 1);
+		if (i >= job->count)
+			break;
 
-int tickCount = 0;
-void tick()
+		job->failures[i] = decodePackEntry(job->pack, &job->entries[i], &textures[i]);
+	}
+}
+const char *decodePackEntry(const unsigned char *pack, const PackEntry *entry, TextureMap *texture)
 {
-	// Handle Player Movement.
-	int dx = math.sin[player.angle] * 10;
-	int dy = math.cos[player.angle] * 10;
-	if (playerInput.m) // Modifier Key Down
+	// Returns NULL, or why the entry couldn't be decoded, taken on the thread that decoded it.
+	if (!validTextureSize(entry->w, entry->h))
+		return "size isn't from 1 to 2048 a side";
+	int w, h, channels;
+	unsigned char *pixels = stbi_load_from_memory(pack + entry->offset, entry->size, &w, &h, &channels, 3);
+	if (pixels == NULL)
+		return stbi_failure_reason();
+	if (w != entry->w || h != entry->h)
 	{
-		// Look.
-		if (playerInput.w) { player.z += 4; }
-		if (playerInput.s) { player.z -= 4; }
-		if (playerInput.a) { player.look += 1; }
-		if (playerInput.d) { player.look -= 1; }
+		stbi_image_free(pixels);
+		return "image size differs from the pack entry";
 	}
-	else // Modifier Key Up
+	texture->w = w;
+	texture->h = h;
+	texture->name = pixels;
+	convertTexture(texture);
+	texture->name = NULL;
+	stbi_image_free(pixels);
+	return NULL;
+}
+bool validTextureSize(int w, int h)
+{
+	// Sides that aren't a power of two are resampled up to one, which still has to fit the mip chain.
+	return w > 0 && h > 0 && w <= MAX_TEXTURE_SIZE && h <= MAX_TEXTURE_SIZE;
+}
+void missingTexture(TextureMap *texture)
+{
+	// Magenta and black checks in place of a texture that couldn't be loaded.
+	unsigned char checks[16 * 16 * 3];
+	for (int i = 0; i < 16 * 16; ++i)
 	{
-		// Movement.
-		if (playerInput.w) { player.x += dx; player.y += dy; }
-		if (playerInput.s) { player.x -= dx; player.y -= dy; }
-		if (playerInput.a) { player.angle -= 4; if (player.angle < 0) { player.angle += 360; } }
-		if (playerInput.d) { player.angle += 4; if (player.angle >= 360) { player.angle -= 360; } }
+		bool magenta = ((i % 16) / 4 + (i / 16) / 4) & 1;
+		checks[i * 3] = checks[i * 3 + 2] = magenta ? 0xff : 0x00;
+		checks[i * 3 + 1] = 0x00;
 	}
-	// Handle Strafing
-	if (playerInput.sr) { player.x += dy; player.y -= dx; }
-	if (playerInput.sl) { player.x -= dy; player.y += dx; }
-
-	tickCount++;
+	texture->w = texture->h = 16;
+	texture->name = checks;
+	convertTexture(texture);
+	texture->name = NULL;
 }
-
-void render()
+int compareNames(const void *a, const void *b)
 {
-	// Draw to Image Buffer.
-	clearBackground(framebuffer[0], BACKGROUND);
-	draw3D(); // Draws to framebuffer 0.
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+int bakeTexturePack(const char *directory, const char *path)
+{
+	// Every image stb_image reads in the directory, in name order, which is the order levels refer to them by.
+	int fileCount;
+	char **names = listDirectory(directory, &fileCount);
+	if (names == NULL) { printf("Error opening %s.\n", directory); return 1; }
+	qsort(names, fileCount, sizeof(char *), compareNames);
+
+	PackEntry *entries = (PackEntry *)calloc(fileCount, sizeof(PackEntry));
+	unsigned char **files = (unsigned char **)calloc(fileCount, sizeof(unsigned char *));
+	int count = 0;
+	for (int i = 0; i < fileCount; ++i)
+	{
+		char filePath[512];
+		size_t size;
+		int w, h, channels;
+		snprintf(filePath, sizeof(filePath), "%s/%s", directory, names[i]);
+		unsigned char *file = readFile(filePath, &size);
+		if (file == NULL || !stbi_info_from_memory(file, size, &w, &h, &channels))
+		{
+			printf("Skipping %s, not an image.\n", filePath);
+			free(file);
+			continue;
+		}
+		if (!validTextureSize(w, h))
+		{
+			printf("Skipping %s, %ix%i isn't from 1 to %i a side.\n", filePath, w, h, MAX_TEXTURE_SIZE);
+			free(file);
+			continue;
+		}
 
-	for (size_t y = 0; y < 16; ++y)
+		const char *extension = strrchr(names[i], '.');
+		int nameLength = extension ? (int)(extension - names[i]) : (int)strlen(names[i]);
+		snprintf(entries[count].name, PACK_NAME_LENGTH, "%.*s", nameLength, names[i]);
+		entries[count].size = size;
+		entries[count].w = w;
+		entries[count].h = h;
+		files[count++] = file;
+	}
+
+	FILE *fp = count > 0 ? fopen(path, "wb") : NULL;
+	if (fp)
 	{
-		for (size_t x = 0; x < 16; ++x)
+		PackHeader header = { { 'P', 'R', 'T', 'P' }, 1, count };
+		unsigned int offset = sizeof(PackHeader) + count * sizeof(PackEntry);
+		for (int i = 0; i < count; ++i)
 		{
-			drawPixel(framebuffer[1], x, y, (RGBA) { 0xff, 0x00, 0xff, 0xff });
+			entries[i].offset = offset;
+			offset += entries[i].size;
 		}
+		fwrite(&header, sizeof(PackHeader), 1, fp);
+		fwrite(entries, sizeof(PackEntry), count, fp);
+		for (int i = 0; i < count; ++i)
+			fwrite(files[i], 1, entries[i].size, fp);
+		fclose(fp);
+		printf("Baked %i textures from %s into %s, %u bytes.\n", count, directory, path, offset);
+	}
+	else
+		printf(count > 0 ? "Error opening %s.\n" : "No images in %s.\n", count > 0 ? path : directory);
+
+	for (int i = 0; i < fileCount; ++i)
+		free(names[i]);
+	for (int i = 0; i < count; ++i)
+		free(files[i]);
+	free(names);
+	free(files);
+	free(entries);
+	return fp ? 0 : 1;
+}
+int exportTextures(const char *directory)
+{
+	// Loaded textures as PPM images, named in texture order, ready for -bakepack.
+	initGame();
+	for (int i = 0; i < textureCount; ++i)
+	{
+		char path[512];
+		snprintf(path, sizeof(path), "%s/T_%0*i.ppm", directory, textureCount > 100 ? 3 : 2, i);
+		FILE *fp = fopen(path, "wb");
+		if (fp == NULL) { printf("Error opening %s.\n", path); cleanupGame(); return 1; }
+
+		fprintf(fp, "P6\n%i %i\n255\n", textures[i].w, textures[i].h);
+		for (int y = 0; y < textures[i].h; ++y)
+			for (int x = 0; x < textures[i].w; ++x)
+				fwrite(&textures[i].texels[y + x * textures[i].h], 1, 3, fp);
+		fclose(fp);
 	}
+	printf("Wrote %i textures to %s.\n", textureCount, directory);
+	cleanupGame();
+	return 0;
 }
+void convertTexture(TextureMap *texture)
+{
+	// Source is packed RGB rows stored bottom-up, walls and surfaces sample it top-down and column by column.
+	// Sides that aren't a power of two are resampled up to one, so coordinates wrap with a mask.
+	const int textureChannels = 3;
+	int sourceWidth = texture->w, sourceHeight = texture->h;
+	while (texture->w & (texture->w - 1)) { texture->w += texture->w & -texture->w; }
+	while (texture->h & (texture->h - 1)) { texture->h += texture->h & -texture->h; }
+	texture->mipCount = 0;
+	texture->texelCount = 0;
+	for (int w = texture->w, h = texture->h; texture->mipCount < MAX_MIP_LEVELS; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1)
+	{
+		texture->mipOffset[texture->mipCount++] = texture->texelCount;
+		texture->texelCount += w * h;
+		if (w == 1 && h == 1)
+			break;
+	}
+	texture->texels = (RGBA *)malloc(texture->texelCount * sizeof(RGBA));
+	for (int x = 0; x < texture->w; ++x)
+	{
+		for (int y = 0; y < texture->h; ++y)
+		{
+			int sx = x * sourceWidth / texture->w, sy = y * sourceHeight / texture->h;
+			const unsigned char *src = &texture->name[(sx + (sourceHeight - sy - 1) * sourceWidth) * textureChannels];
+			texture->texels[y + x * texture->h] = (RGBA){ src[0], src[1], src[2], 0xff };
+		}
+	}
 
-void clearBackground(unsigned char *framebuffer, const RGBA color)
+	// Mip levels, each texel the box filtered average of the 2x2 texels above it.
+	for (int level = 1; level < texture->mipCount; ++level)
+	{
+		int sw = texture->w >> (level - 1), sh = texture->h >> (level - 1);
+		if (sw < 1) { sw = 1; }
+		if (sh < 1) { sh = 1; }
+		int dw = sw > 1 ? sw / 2 : 1, dh = sh > 1 ? sh / 2 : 1;
+		const RGBA *src = texture->texels + texture->mipOffset[level - 1];
+		RGBA *dst = texture->texels + texture->mipOffset[level];
+		for (int x = 0; x < dw; ++x)
+		{
+			int x0 = x * 2, x1 = x * 2 + 1 < sw ? x * 2 + 1 : sw - 1;
+			for (int y = 0; y < dh; ++y)
+			{
+				int y0 = y * 2, y1 = y * 2 + 1 < sh ? y * 2 + 1 : sh - 1;
+				RGBA a = src[y0 + x0 * sh], b = src[y1 + x0 * sh], c = src[y0 + x1 * sh], d = src[y1 + x1 * sh];
+				dst[y + x * dh] = (RGBA){ (a.r + b.r + c.r + d.r + 2) / 4, (a.g + b.g + c.g + d.g + 2) / 4, (a.b + b.b + c.b + d.b + 2) / 4, 0xff };
+			}
+		}
+	}
+
+	// Z-order copy, so surfaces sampled along any angle stay within nearby cache lines.
+	int side = texture->w < texture->h ? texture->w : texture->h;
+	texture->tileShift = 0;
+	while ((1 << texture->tileShift) < side)
+		texture->tileShift++;
+	texture->swizzled = (RGBA *)malloc(texture->w * texture->h * sizeof(RGBA));
+	TextureDescriptor layout;
+	describeTexture(&layout, texture);
+	for (int x = 0; x < texture->w; ++x)
+		for (int y = 0; y < texture->h; ++y)
+			texture->swizzled[swizzledIndex(&layout, x, y)] = texture->texels[y + x * texture->h];
+}
+void buildAtlas()
 {
-	for (size_t y = 0; y < buffer_height; ++y)
+	// Pack the converted textures into one aligned buffer and describe each of their levels.
+	// Streamed textures aren't loaded yet, they are described when they become resident.
+	atlasTexels = 0;
+	for (int i = 0; i < textureCount; ++i)
+		if (textures[i].texels)
+			atlasTexels += (textures[i].texelCount + 15) & ~15;
+	textureAtlas = (RGBA *)alignedAlloc(atlasTexels * sizeof(RGBA));
+
+	size_t base = 0;
+	for (int i = 0; i < textureCount; ++i)
 	{
-		for (size_t x = 0; x < buffer_width; ++x)
+		if (!textures[i].texels)
+			continue;
+		memcpy(textureAtlas + base, textures[i].texels, textures[i].texelCount * sizeof(RGBA));
+		free(textures[i].texels);
+		textures[i].texels = textureAtlas + base;
+		describeTexture(&textureDescriptors[i], &textures[i]);
+		base += (textures[i].texelCount + 15) & ~15;
+	}
+}
+void describeTexture(TextureDescriptor *descriptor, const TextureMap *texture)
+{
+	descriptor->texels = texture->texels;
+	descriptor->indices = texture->indices;
+	descriptor->mipCount = texture->mipCount;
+	descriptor->swizzled = texture->swizzled;
+	descriptor->tileShift = texture->tileShift;
+	for (int l = 0; l < texture->mipCount; ++l)
+	{
+		TextureLevel *level = &descriptor->levels[l];
+		int w = texture->w >> l, h = texture->h >> l;
+		if (w < 1) { w = 1; }
+		if (h < 1) { h = 1; }
+		level->offset = texture->mipOffset[l];
+		level->wShift = level->hShift = 0;
+		while ((1 << level->wShift) < w) { level->wShift++; }
+		while ((1 << level->hShift) < h) { level->hShift++; }
+		level->wMask = w - 1;
+		level->hMask = h - 1;
+	}
+}
+void *alignedAlloc(size_t size)
+{
+	// 64 byte aligned, a whole number of cache lines.
+	size = (size + 63) & ~(size_t)63;
+#ifdef _WIN32
+	return _aligned_malloc(size, 64);
+#else
+	return aligned_alloc(64, size);
+#endif
+}
+void alignedFree(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+int mipLevel(const TextureDescriptor *descriptor, float step)
+{
+	// First level that steps less than two texels per pixel.
+	int level = 0;
+	while (step >= 2.0f && level < descriptor->mipCount - 1)
+	{
+		step *= 0.5f;
+		level++;
+	}
+	return level;
+}
+unsigned int mortonIndex(unsigned int u, unsigned int v)
+{
+	// Interleave u into the even bits and v into the odd bits.
+#ifdef HAS_BMI2
+	return _pdep_u32(u, 0x55555555) | _pdep_u32(v, 0xAAAAAAAA);
+#else
+	u = (u | (u << 8)) & 0x00FF00FF;
+	u = (u | (u << 4)) & 0x0F0F0F0F;
+	u = (u | (u << 2)) & 0x33333333;
+	u = (u | (u << 1)) & 0x55555555;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return u | (v << 1);
+#endif
+}
+unsigned int swizzledIndex(const TextureDescriptor *descriptor, unsigned int u, unsigned int v)
+{
+	// Wrap, then find the square tile and the Z-order offset inside it.
+	u &= descriptor->levels[0].wMask;
+	v &= descriptor->levels[0].hMask;
+	unsigned int mask = (1u << descriptor->tileShift) - 1;
+	unsigned int tile = (u >> descriptor->tileShift) + (v >> descriptor->tileShift);
+	return (tile << (descriptor->tileShift * 2)) + mortonIndex(u & mask, v & mask);
+}
+int medianChannel;
+int compareChannel(const void *a, const void *b)
+{
+	return ((const unsigned char *)a)[medianChannel] - ((const unsigned char *)b)[medianChannel];
+}
+void measureBox(const RGBA *texels, int start, int end, int *range, int *channel)
+{
+	// Widest of the red, green and blue ranges in a median cut box.
+	*range = 0;
+	*channel = 0;
+	for (int c = 0; c < 3; ++c)
+	{
+		int low = 255, high = 0;
+		for (int i = start; i < end; ++i)
 		{
-			drawPixel(framebuffer, x, y, color);
+			int value = ((const unsigned char *)&texels[i])[c];
+			if (value < low) { low = value; }
+			if (value > high) { high = value; }
 		}
+		if (high - low > *range) { *range = high - low; *channel = c; }
 	}
 }
-void drawPixel(unsigned char *framebuffer, const int x, const int y, const RGBA color)
+void buildPalette()
 {
-	if (x > buffer_width-1 || x < 0 || y > buffer_height-1 || y < 0) // Only draw pixel within buffer resolution.
-		return;
+	// Median cut over every texel, lit and shaded, so the textures share one palette that still has dark tones for
+	// shaded walls, and the scene needs a byte per pixel.
+	const float shades[] = { 1.0f, 0.75f, 0.5f };
+	const int shadeCount = sizeof(shades) / sizeof(float);
+	int texelCount = 0;
+	for (int i = 0; i < textureCount; ++i)
+		if (textures[i].texels)
+			texelCount += textures[i].w * textures[i].h * shadeCount;
+	RGBA *texels = (RGBA *)malloc(texelCount * sizeof(RGBA));
+	texelCount = 0;
+	for (int i = 0; i < textureCount; ++i)
+		for (int s = 0; s < shadeCount && textures[i].texels; ++s)
+			for (int t = 0; t < textures[i].w * textures[i].h; ++t)
+			{
+				RGBA texel = textures[i].texels[t];
+				texels[texelCount++] = (RGBA){ texel.r * shades[s], texel.g * shades[s], texel.b * shades[s], 0xff };
+			}
 
-	int xx = x * buffer_channels;
-	int yy = y * buffer_channels;
-	int index = xx + yy * buffer_width;
+	// Split the box with the widest channel at its median until the palette is full.
+	int start[256] = { 0 }, end[256] = { texelCount }, range[256], channel[256];
+	int boxes = 1;
+	measureBox(texels, start[0], end[0], &range[0], &channel[0]);
+	while (boxes < 255)
+	{
+		int widest = 0;
+		for (int b = 1; b < boxes; ++b)
+			if (range[b] > range[widest]) { widest = b; }
+		if (range[widest] == 0)
+			break; // Every box holds one color.
+
+		medianChannel = channel[widest];
+		qsort(texels + start[widest], end[widest] - start[widest], sizeof(RGBA), compareChannel);
+		int median = (start[widest] + end[widest]) / 2;
+		start[boxes] = median;
+		end[boxes] = end[widest];
+		end[widest] = median;
+		measureBox(texels, start[widest], end[widest], &range[widest], &channel[widest]);
+		measureBox(texels, start[boxes], end[boxes], &range[boxes], &channel[boxes]);
+		boxes++;
+	}
 
-	framebuffer[index++] = color.r;
-	framebuffer[index++] = color.g;
-	framebuffer[index++] = color.b;
-	framebuffer[index++] = color.a;
+	// Entry 0 is kept for the background, every box becomes the average of its texels.
+	palette.colors[0] = BACKGROUND;
+	for (int b = 0; b < boxes; ++b)
+	{
+		unsigned int r = 0, g = 0, bl = 0, n = end[b] - start[b];
+		for (int i = start[b]; i < end[b]; ++i) { r += texels[i].r; g += texels[i].g; bl += texels[i].b; }
+		palette.colors[b + 1] = (RGBA){ (r + n / 2) / n, (g + n / 2) / n, (bl + n / 2) / n, 0xff };
+	}
+	palette.colorCount = boxes + 1;
+	free(texels);
+
+	// Remap the textures and their mip levels, at the same offsets as their texels in the atlas.
+	indexAtlas = (unsigned char *)alignedAlloc(atlasTexels);
+	for (int i = 0; i < textureCount; ++i)
+	{
+		if (!textures[i].texels)
+			continue;
+		textures[i].indices = indexAtlas + (textures[i].texels - textureAtlas);
+		textureDescriptors[i].indices = textures[i].indices;
+		for (int t = 0; t < textures[i].texelCount; ++t)
+			textures[i].indices[t] = nearestColor(textures[i].texels[t].r, textures[i].texels[t].g, textures[i].texels[t].b);
+	}
+
+	// Wall lighting becomes a table lookup, in the same steps drawWall shades RGBA walls by.
+	for (int level = 0; level < PALETTE_LIGHT_LEVELS; ++level)
+	{
+		float shade = 1 - level * 0.01f;
+		palette.colormap[level][0] = 0;
+		for (int c = 1; c < 256; ++c)
+		{
+			RGBA color = palette.colors[c < palette.colorCount ? c : 0];
+			palette.colormap[level][c] = nearestColor(color.r * shade, color.g * shade, color.b * shade);
+		}
+	}
 }
-void combineFramebuffers()
+unsigned char nearestColor(int r, int g, int b)
 {
-	clearBackground(framebuffer[3], (RGBA) { 0x00, 0x00, 0x00, 0xff });
-	for (size_t y = 0; y < buffer_height; ++y)
+	// Texture entries only, so nothing darkens into the background.
+	int best = 1, bestDistance = 3 * 256 * 256;
+	for (int c = 1; c < palette.colorCount; ++c)
 	{
-		for (size_t x = 0; x < buffer_width; ++x)
-		{
-			int xx = x * buffer_channels;
-			int yy = y * buffer_channels;
-			int sample = xx + yy * buffer_width;
+		int dr = r - palette.colors[c].r, dg = g - palette.colors[c].g, db = b - palette.colors[c].b;
+		int distance = dr * dr + dg * dg + db * db;
+		if (distance < bestDistance) { best = c; bestDistance = distance; }
+	}
+	return best;
+}
+const RGBA *shadedTexture(int texture, int shade)
+{
+	// Wall texture with the wall's shade applied, built on first use and kept while it fits the budget.
+	int level = shade / 2;
+	if (shadeCache.budget == 0 || texture < 0 || texture >= textureCount || !textures[texture].texels || level < 0 || level >= SHADE_LEVELS)
+		return NULL;
+
+	int slot = shadeCache.lookup[texture][level] - 1;
+	if (slot >= 0)
+	{
+		shadeCache.entries[slot].lastUsed = ++shadeCache.clock;
+		shadeCache.hits++;
+		return shadeCache.entries[slot].texels;
+	}
 
-			for (size_t i = 0; i < fbuffer_count-1; ++i)
+	size_t size = textures[texture].texelCount * sizeof(RGBA);
+	if (size > shadeCache.budget)
+		return NULL;
+
+	// Evict the least recently used copies until this one fits in a free entry.
+	for (;;)
+	{
+		int freeSlot = -1, oldest = -1;
+		for (int i = 0; i < SHADE_CACHE_ENTRIES; ++i)
+		{
+			if (!shadeCache.entries[i].texels)
 			{
-				if (framebuffer[i][sample + 3] == 0x00)
-					continue;
-				framebuffer[3][sample] = framebuffer[i][sample];
-				framebuffer[3][sample + 1] = framebuffer[i][sample + 1];
-				framebuffer[3][sample + 2] = framebuffer[i][sample + 2];
-				framebuffer[3][sample + 3] = framebuffer[i][sample + 3];
+				if (freeSlot < 0) { freeSlot = i; }
+				continue;
 			}
+			if (oldest < 0 || shadeCache.entries[i].lastUsed < shadeCache.entries[oldest].lastUsed) { oldest = i; }
 		}
+		if (freeSlot >= 0 && shadeCache.used + size <= shadeCache.budget)
+		{
+			slot = freeSlot;
+			break;
+		}
+
+		ShadedTexture *evicted = &shadeCache.entries[oldest];
+		shadeCache.lookup[evicted->texture][evicted->level] = 0;
+		shadeCache.used -= evicted->size;
+		free(evicted->texels);
+		evicted->texels = 0;
+		shadeCache.evictions++;
 	}
-}
 
-void loadScene()
+	// Same arithmetic as shading per pixel, so cached walls are identical.
+	ShadedTexture *entry = &shadeCache.entries[slot];
+	float factor = 1 - (level * 0.01f);
+	entry->texture = texture;
+	entry->level = level;
+	entry->size = size;
+	entry->lastUsed = ++shadeCache.clock;
+	entry->texels = (RGBA *)malloc(size);
+	for (int t = 0; t < textures[texture].texelCount; ++t)
+	{
+		RGBA texel = textures[texture].texels[t];
+		entry->texels[t] = (RGBA){ texel.r * factor, texel.g * factor, texel.b * factor, 0xff };
+	}
+	shadeCache.lookup[texture][level] = slot + 1;
+	shadeCache.used += size;
+	shadeCache.misses++;
+	return entry->texels;
+}
+void releaseShadedTextures(int texture)
 {
-	// Open and read file.
-	FILE *fp = fopen("./res/levels/level", "r");
-	if (fp == NULL) { printf("Error opening level."); return; }
-
-	// Load Scene.
-	fscanf(fp, "%i", &sectorCount);				// Number of sectors.
-	for (int s = 0; s < sectorCount; s++)		// Loop through sectors.
-	{
-		fscanf(fp, "%i", &sectors[s].ws);
-		fscanf(fp, "%i", &sectors[s].we);
-		fscanf(fp, "%i", &sectors[s].z1);
-		fscanf(fp, "%i", &sectors[s].z2);
-		fscanf(fp, "%i", &sectors[s].st);
-		fscanf(fp, "%i", &sectors[s].ss);
-	}
-	fscanf(fp, "%i", &wallCount);				// Number of walls.
-	for (int w = 0; w < wallCount; w++)			// Loop through walls.
-	{
-		fscanf(fp, "%i", &walls[w].x1);
-		fscanf(fp, "%i", &walls[w].y1);
-		fscanf(fp, "%i", &walls[w].x2);
-		fscanf(fp, "%i", &walls[w].y2);
-		fscanf(fp, "%i", &walls[w].wt);
-		fscanf(fp, "%i", &walls[w].u);
-		fscanf(fp, "%i", &walls[w].v);
-		fscanf(fp, "%i", &walls[w].shade);
+	// Every shaded copy of a texture that is going away.
+	for (int level = 0; level < SHADE_LEVELS; ++level)
+	{
+		int slot = shadeCache.lookup[texture][level] - 1;
+		if (slot < 0)
+			continue;
+		shadeCache.used -= shadeCache.entries[slot].size;
+		free(shadeCache.entries[slot].texels);
+		shadeCache.entries[slot].texels = 0;
+		shadeCache.lookup[texture][level] = 0;
 	}
-	// Load player properties.
-	fscanf(fp, "%i %i %i %i %i", &player.x, &player.y, &player.z, &player.angle, &player.look);
-
-	// Close file.
-	fclose(fp);
 }
+bool startResidency()
+{
+	// Every texture starts out drawn with the placeholder until the loader thread has decoded it.
+	residency.state = (volatile int *)calloc(textureCount, sizeof(int));
+	residency.lastUsed = (unsigned int *)calloc(textureCount, sizeof(unsigned int));
+	residency.requested = (double *)calloc(textureCount, sizeof(double));
+	residency.loaded = (TextureMap *)calloc(textureCount, sizeof(TextureMap));
+	residency.queue = (int *)calloc(textureCount, sizeof(int));
+	for (int i = 0; i < textureCount; ++i)
+		textureDescriptors[i] = placeholderTexture;
+
+	residency.stop = false;
+	if (!createSignal(&residency.wake))
+		return false;
+	residency.started = startThread(&residency.loader, loadQueuedTextures, NULL);
+	if (!residency.started)
+		destroySignal(residency.wake);
+	return residency.started;
+}
+void stopResidency()
+{
+	if (residency.started)
+	{
+		residency.stop = true;
+		raiseSignal(residency.wake);
+		joinThread(residency.loader);
+		destroySignal(residency.wake);
+		residency.started = false;
+	}
 
-void draw3D()
+	// Resident textures are allocated on their own rather than in the atlas.
+	for (int i = 0; i < textureCount && residency.state; ++i)
+	{
+		if (residency.state[i] == TEXTURE_RESIDENT)
+			free(textures[i].texels);
+		if (residency.state[i] == TEXTURE_READY)
+		{
+			free(residency.loaded[i].texels);
+			free(residency.loaded[i].swizzled);
+		}
+	}
+	free((void *)residency.state);
+	free(residency.lastUsed);
+	free(residency.requested);
+	free(residency.loaded);
+	free(residency.queue);
+	residency.state = 0;
+	residency.lastUsed = 0;
+	residency.requested = 0;
+	residency.loaded = 0;
+	residency.queue = 0;
+	residency.head = residency.tail = 0;
+	residency.used = 0;
+	residency.resident = residency.pending = 0;
+}
+void loadQueuedTextures(void *arg)
 {
-	int cycles = 0;
+	// Loader thread: decodes queued textures from the mapped pack in the order they were asked for.
+	traceThreadName("texture loader");
+	const PackEntry *entries = (const PackEntry *)(texturePack + sizeof(PackHeader));
+	while (!residency.stop)
+	{
+		if (residency.head == residency.tail)
+		{
+			waitSignal(residency.wake);
+			continue;
+		}
+		atomicFence();
+		int i = residency.queue[residency.head % textureCount];
+		traceBegin("load texture", i);
+		const char *failure = decodePackEntry(texturePack, &entries[i], &residency.loaded[i]);
+		if (failure)
+		{
+			printf("Texture %.*s could not be decoded: %s\n", PACK_NAME_LENGTH, entries[i].name, failure);
+			missingTexture(&residency.loaded[i]);
+		}
+		traceEnd("load texture");
+		atomicFence();
+		residency.state[i] = TEXTURE_READY;
+		residency.head++;
+	}
+	traceThreadExit();
+}
+void requestTexture(int texture, bool drawn)
+{
+	// Keep a texture that is drawn or about to be, and queue it for the loader if it isn't resident.
+	residency.lastUsed[texture] = residency.frame;
+	if (residency.state[texture] == TEXTURE_RESIDENT)
+		return;
+	if (drawn)
+		residency.placeholderDraws++;
+	if (residency.state[texture] != TEXTURE_NOT_RESIDENT)
+		return;
 
-	// Draw 3D
-	int wx[4], wy[4], wz[4]; // World Positions
-	float CS = math.cos[player.angle]; // Player Cosine
-	float SN = math.sin[player.angle]; // Player Sine
+	residency.state[texture] = TEXTURE_QUEUED;
+	residency.requested[texture] = getTime();
+	residency.pending++;
+	residency.queue[residency.tail % textureCount] = texture;
+	atomicFence();
+	residency.tail++;
+	raiseSignal(residency.wake);
+}
+void updateResidency()
+{
+	// Install what the loader has finished, then evict textures no frame needed lately until under budget.
+	residency.frame++;
+	for (int i = 0; i < textureCount && residency.pending > 0; ++i)
+	{
+		if (residency.state[i] != TEXTURE_READY)
+			continue;
+		atomicFence();
+		textures[i] = residency.loaded[i];
+		describeTexture(&textureDescriptors[i], &textures[i]);
+		residency.state[i] = TEXTURE_RESIDENT;
+		residency.used += residentSize(&textures[i]);
+		residency.resident++;
+		residency.pending--;
+
+		double loadMs = (getTime() - residency.requested[i]) * 1000.0;
+		residency.loadMs += loadMs;
+		if (loadMs > residency.maxLoadMs) { residency.maxLoadMs = loadMs; }
+		residency.loads++;
+	}
 
-	// Sort sectors.
+	while (residency.used > residency.budget)
+	{
+		int coldest = -1;
+		for (int i = 0; i < textureCount; ++i)
+		{
+			if (residency.state[i] != TEXTURE_RESIDENT || residency.lastUsed[i] + 1 >= residency.frame)
+				continue;
+			if (coldest < 0 || residency.lastUsed[i] < residency.lastUsed[coldest]) { coldest = i; }
+		}
+		if (coldest < 0)
+			break; // Everything resident was needed last frame, the budget is too small for the view.
+
+		releaseShadedTextures(coldest);
+		residency.used -= residentSize(&textures[coldest]);
+		free(textures[coldest].texels);
+		free(textures[coldest].swizzled);
+		textures[coldest].texels = 0;
+		textures[coldest].swizzled = 0;
+		textureDescriptors[coldest] = placeholderTexture;
+		residency.state[coldest] = TEXTURE_NOT_RESIDENT;
+		residency.resident--;
+		residency.evictions++;
+	}
+}
+void buildPrefetchLists()
+{
+	// A visible sector prefetches the textures of the sectors whose bounds come within RESIDENCY_NEIGHBOUR_DISTANCE
+	// of its own, so they are loaded by the time the player can see them.
+	int bounds[128][4];
 	for (int s = 0; s < sectorCount; ++s)
 	{
-		for (int w = 0; w < sectorCount-s-1; ++w)
+		bounds[s][0] = bounds[s][2] = walls[sectors[s].ws].x1;
+		bounds[s][1] = bounds[s][3] = walls[sectors[s].ws].y1;
+		for (int w = sectors[s].ws; w < sectors[s].we; ++w)
 		{
-			if (sectors[w].d < sectors[w+1].d)
-			{
-				Sector st = sectors[w];
-				sectors[w] = sectors[w+1];
-				sectors[w+1] = st;
-			}
+			int x1 = walls[w].x1 < walls[w].x2 ? walls[w].x1 : walls[w].x2, x2 = walls[w].x1 < walls[w].x2 ? walls[w].x2 : walls[w].x1;
+			int y1 = walls[w].y1 < walls[w].y2 ? walls[w].y1 : walls[w].y2, y2 = walls[w].y1 < walls[w].y2 ? walls[w].y2 : walls[w].y1;
+			if (x1 < bounds[s][0]) { bounds[s][0] = x1; }
+			if (y1 < bounds[s][1]) { bounds[s][1] = y1; }
+			if (x2 > bounds[s][2]) { bounds[s][2] = x2; }
+			if (y2 > bounds[s][3]) { bounds[s][3] = y2; }
 		}
 	}
 
-	// Draw Sectors.
+	memset(residency.prefetch, -1, sizeof(residency.prefetch));
 	for (int s = 0; s < sectorCount; ++s)
 	{
-		sectors[s].d = 0; // Clear distance.
-
-		if		(player.z < sectors[s].z1)	{ sectors[s].surface = 1; cycles = 2; for (int x = 0; x < buffer_width; ++x) { sectors[s].surf[x] = buffer_height; } }
-		else if (player.z > sectors[s].z2)	{ sectors[s].surface = 2; cycles = 2; for (int x = 0; x < buffer_width; ++x) { sectors[s].surf[x] = 0; } }
-		else								{ sectors[s].surface = 0; cycles = 1; }
-
-		for (int frontBack = 0; frontBack < cycles; ++frontBack)
+		short *list = residency.prefetch[sectors[s].ws];
+		int count = 0;
+		for (int n = 0; n < sectorCount && count < RESIDENCY_PREFETCH; ++n)
 		{
-			for (int w = sectors[s].ws; w < sectors[s].we; ++w) // Loop through walls
-			{
-				// Offset by player.
-				int x1 = walls[w].x1 - player.x;
-				int x2 = walls[w].x2 - player.x;
-				int y1 = walls[w].y1 - player.y;
-				int y2 = walls[w].y2 - player.y;
+			const int d = RESIDENCY_NEIGHBOUR_DISTANCE;
+			if (n == s || bounds[n][0] > bounds[s][2] + d || bounds[s][0] > bounds[n][2] + d ||
+				bounds[n][1] > bounds[s][3] + d || bounds[s][1] > bounds[n][3] + d)
+				continue;
+
+			// The neighbour's surface texture, then its wall textures.
+			for (int w = sectors[n].ws - 1; w < sectors[n].we && count < RESIDENCY_PREFETCH; ++w)
+			{
+				int texture = w < sectors[n].ws ? sectors[n].st : walls[w].wt;
+				bool listed = false;
+				for (int i = 0; i < count; ++i)
+					listed |= list[i] == texture;
+				if (!listed)
+					list[count++] = texture;
+			}
+		}
+	}
+}
+size_t residentSize(const TextureMap *texture)
+{
+	// Texels with their mip levels, and the Z-order copy.
+	return (texture->texelCount + texture->w * texture->h) * sizeof(RGBA);
+}
+void cleanupGame()
+{
+	stopDemo();
+
+	for (int i = 0; i < SHADE_CACHE_ENTRIES; ++i)
+		free(shadeCache.entries[i].texels);
+	memset(shadeCache.entries, 0, sizeof(shadeCache.entries));
+	free(shadeCache.lookup);
+	shadeCache.lookup = 0;
+	shadeCache.used = 0;
+
+	stopChunkStreaming();
+	stopResidency();
+	for (int i = 0; i < textureCount; ++i)
+		free(textures[i].swizzled);
+	free(textures);
+	textures = 0;
+	free(textureDescriptors);
+	textureDescriptors = 0;
+	textureCount = 0;
+	alignedFree(textureAtlas);
+	textureAtlas = 0;
+	alignedFree(indexAtlas);
+	indexAtlas = 0;
+	if (texturePack)
+		unmapFile(texturePack, texturePackSize);
+	texturePack = 0;
+}
+
+int tickCount = 0;
+void tick()
+{
+	profileBegin(STAGE_TICK);
+
+	// Feed Demo.
+	if (demo.playing)
+		playDemoTick();
+	else if (demo.recording)
+		recordDemoTick();
+
+	// First tick after a key event reflects it.
+	if (latency.pendingInput > 0)
+	{
+		if (latency.ticked.input == 0)
+		{
+			latency.ticked.input = latency.pendingInput;
+			latency.ticked.tick = getTime();
+		}
+		latency.pendingInput = 0;
+	}
+
+	// Reload level on tick boundary so demos stay deterministic.
+	if (levelReloadPending)
+	{
+		loadScene();
+		levelReloadPending = false;
+	}
+
+	// HUD timings refresh once per tick while the view is idle.
+	if (profiler.hud)
+		renderOnChange.layersDirty = true;
+
+	// Handle Player Movement.
+	int dx = math.sin[player.angle] * 10;
+	int dy = math.cos[player.angle] * 10;
+	if (playerInput.m) // Modifier Key Down
+	{
+		// Look.
+		if (playerInput.w) { player.z += 4; }
+		if (playerInput.s) { player.z -= 4; }
+		if (playerInput.a) { player.look += 1; }
+		if (playerInput.d) { player.look -= 1; }
+	}
+	else // Modifier Key Up
+	{
+		// Movement.
+		if (playerInput.w) { player.x += dx; player.y += dy; }
+		if (playerInput.s) { player.x -= dx; player.y -= dy; }
+		if (playerInput.a) { player.angle -= 4; if (player.angle < 0) { player.angle += 360; } }
+		if (playerInput.d) { player.angle += 4; if (player.angle >= 360) { player.angle -= 360; } }
+	}
+	// Handle Strafing
+	if (playerInput.sr) { player.x += dy; player.y -= dx; }
+	if (playerInput.sl) { player.x -= dy; player.y += dx; }
+
+	tickCount++;
+
+	profileEnd(STAGE_TICK);
+}
+
+void renderFrame()
+{
+	double frameStart = getTime();
+
+	// The level and textures change here rather than in render(), so the watchdog keeps what the frame drew.
+	if (chunks.enabled)
+		updateChunks();
+	if (residency.enabled)
+		updateResidency();
+
+	if (watchdog.thresholdMs > 0)
+		watchdogBeginFrame();
+
+	startOpenGLRender();
+	if (latency.inFlight.input > 0)
+		latency.inFlight.upload = getTime();
+
+	if (dynamicResolution.enabled)
+		updateDynamicResolution();
+
+	render();
+	if (latency.ticked.input > 0)
+	{
+		latency.rendered = latency.ticked;
+		latency.rendered.render = getTime();
+		latency.ticked = (FrameStamps){ 0 };
+	}
+
+	combineFramebuffers();
+	if (latency.rendered.input > 0)
+		latency.rendered.composite = getTime();
+
+	endOpenGLRender();
+
+	if (watchdog.thresholdMs > 0)
+		watchdogEndFrame();
+	profileEndFrame();
+
+	if (dynamicResolution.enabled)
+		dynamicResolution.frameMs[dynamicResolution.frames++ % DYNRES_WINDOW] = (getTime() - frameStart) * 1000.0;
+	if (columnLOD.budgetMs > 0)
+		updateColumnLOD();
+}
+void presentFrame()
+{
+	traceBegin("glfwSwapBuffers", -1);
+	glfwSwapBuffers(window);
+	traceEnd("glfwSwapBuffers");
+
+	if (latency.enabled)
+		latencyPresent();
+}
+void render()
+{
+	traceBegin("render", -1);
+
+	if (overdraw.enabled)
+		overdrawBeginFrame();
+
+	if (interlace.enabled)
+		beginInterlacedFrame();
+
+	// Draw to Image Buffer.
+	overdraw.pass = PASS_CLEAR;
+	clearScene(BACKGROUND);
+	draw3D(); // Draws to framebuffer 0.
+
+	overdraw.pass = PASS_OVERLAY;
+	for (size_t y = 0; y < 16; ++y)
+	{
+		for (size_t x = 0; x < 16; ++x)
+		{
+			drawPixel(framebuffer[1], x, y, (RGBA) { 0xff, 0x00, 0xff, 0xff });
+		}
+	}
+
+	if (profiler.hud)
+		drawProfilerHUD(framebuffer[2]);
+
+	if (overdraw.enabled)
+		drawOverdrawHeatmap(framebuffer[1]);
+
+	traceEnd("render");
+}
+
+void beginInterlacedFrame()
+{
+	// Alternate even and odd columns, unless the kept half would no longer line up.
+	int turn = abs(player.angle - interlace.player.angle);
+	if (turn > 180) { turn = 360 - turn; }
+	bool refresh = interlace.frame == 0 || turn > interlace.maxTurn || player.look != interlace.player.look ||
+		levelGeneration != interlace.levelGeneration || scene_width != interlace.sceneWidth || scene_height != interlace.sceneHeight;
+
+	interlace.parity = refresh ? -1 : interlace.frame & 1;
+	interlace.stale = !refresh && memcmp(&player, &interlace.player, sizeof(Player)) != 0;
+	interlace.frame++;
+	interlace.player = player;
+	interlace.levelGeneration = levelGeneration;
+	interlace.sceneWidth = scene_width;
+	interlace.sceneHeight = scene_height;
+}
+void clearScene(const RGBA color)
+{
+	int step = interlace.parity < 0 ? 1 : 2;
+	for (int y = 0; y < scene_height; ++y)
+	{
+		for (int x = interlace.parity < 0 ? 0 : interlace.parity; x < scene_width; x += step)
+		{
+			if (palettized)
+				drawSceneIndex(x, y, 0);
+			else
+				drawScenePixel(x, y, color);
+		}
+	}
+}
+void clearBackground(unsigned char *framebuffer, const RGBA color)
+{
+	for (size_t y = 0; y < buffer_height; ++y)
+	{
+		for (size_t x = 0; x < buffer_width; ++x)
+		{
+			drawPixel(framebuffer, x, y, color);
+		}
+	}
+}
+void drawPixel(unsigned char *framebuffer, const int x, const int y, const RGBA color)
+{
+	if (x > buffer_width-1 || x < 0 || y > buffer_height-1 || y < 0) // Only draw pixel within buffer resolution.
+		return;
+
+	int xx = x * buffer_channels;
+	int yy = y * buffer_channels;
+	int index = xx + yy * buffer_width;
+
+	if (overdraw.enabled)
+		countOverdraw(x, y);
+
+	framebuffer[index++] = color.r;
+	framebuffer[index++] = color.g;
+	framebuffer[index++] = color.b;
+	framebuffer[index++] = color.a;
+}
+void drawScenePixel(const int x, const int y, const RGBA color)
+{
+	if (x > scene_width-1 || x < 0 || y > scene_height-1 || y < 0) // Only draw pixel within scene resolution.
+		return;
+
+	// In column-major mode columns are contiguous, so a vertical span writes sequential memory.
+	int index = columnMajor ? (y + x * scene_height) * buffer_channels : (x + y * scene_width) * buffer_channels;
+
+	if (overdraw.enabled)
+		countOverdraw(x, y);
+
+	framebuffer[0][index++] = color.r;
+	framebuffer[0][index++] = color.g;
+	framebuffer[0][index++] = color.b;
+	framebuffer[0][index++] = color.a;
+}
+void drawSceneIndex(const int x, const int y, const unsigned char index)
+{
+	if (x > scene_width-1 || x < 0 || y > scene_height-1 || y < 0) // Only draw pixel within scene resolution.
+		return;
+
+	if (overdraw.enabled)
+		countOverdraw(x, y);
+
+	sceneIndices[columnMajor ? y + x * scene_height : x + y * scene_width] = index;
+}
+void countOverdraw(const int x, const int y)
+{
+	overdraw.writes[overdraw.pass]++;
+	if (overdraw.pass == PASS_WALLS || overdraw.pass == PASS_SURFACES)
+	{
+		overdraw.counts[x + y * buffer_width]++;
+		overdraw.sectorWrites[overdraw.sector]++;
+	}
+}
+void combineFramebuffers()
+{
+	profileBegin(STAGE_COMBINE);
+
+	overdraw.pass = PASS_COMPOSITE;
+	unsigned int writes = 0;
+
+	unsigned char *layers[3] = { framebuffer[0], framebuffer[1], framebuffer[2] };
+	if (palettized)
+	{
+		expandIndices((unsigned int *)sceneRows, sceneIndices, scene_width, scene_height);
+		layers[0] = sceneRows;
+	}
+	else if (columnMajor)
+	{
+		transposeColumns((unsigned int *)sceneRows, (const unsigned int *)framebuffer[0], scene_width, scene_height);
+		layers[0] = sceneRows;
+	}
+
+	// With dynamic resolution the scene is uploaded on its own and scaled by the GPU,
+	// so only the overlays are combined and empty pixels stay transparent.
+	bool split = dynamicResolution.enabled;
+	clearBackground(framebuffer[3], (RGBA) { 0x00, 0x00, 0x00, split ? 0x00 : 0xff });
+	for (size_t y = 0; y < buffer_height; ++y)
+	{
+		for (size_t x = 0; x < buffer_width; ++x)
+		{
+			int xx = x * buffer_channels;
+			int yy = y * buffer_channels;
+			int sample = xx + yy * buffer_width;
+
+			for (size_t i = split ? 1 : 0; i < fbuffer_count-1; ++i)
+			{
+				if (layers[i][sample + 3] == 0x00)
+					continue;
+				framebuffer[3][sample] = layers[i][sample];
+				framebuffer[3][sample + 1] = layers[i][sample + 1];
+				framebuffer[3][sample + 2] = layers[i][sample + 2];
+				framebuffer[3][sample + 3] = layers[i][sample + 3];
+				writes++;
+			}
+		}
+	}
+	overdraw.writes[PASS_COMPOSITE] += writes;
+
+	profileEnd(STAGE_COMBINE);
+}
+void transposeColumns(unsigned int *dst, const unsigned int *src, int width, int height)
+{
+	// Column-major src to row-major dst in 16x16 pixel blocks, so both sides stay within a few cache lines.
+	const int block = 16;
+	for (int by = 0; by < height; by += block)
+	{
+		for (int bx = 0; bx < width; bx += block)
+		{
+			int ey = by + block < height ? by + block : height;
+			int ex = bx + block < width ? bx + block : width;
+			int y = by;
+#ifdef HAS_SSE2
+			for (; y + 4 <= ey; y += 4)
+			{
+				int x = bx;
+				for (; x + 4 <= ex; x += 4)
+				{
+					// Four columns of four pixels become four rows.
+					__m128i c0 = _mm_loadu_si128((const __m128i *)&src[y + (x + 0) * height]);
+					__m128i c1 = _mm_loadu_si128((const __m128i *)&src[y + (x + 1) * height]);
+					__m128i c2 = _mm_loadu_si128((const __m128i *)&src[y + (x + 2) * height]);
+					__m128i c3 = _mm_loadu_si128((const __m128i *)&src[y + (x + 3) * height]);
+					__m128i t0 = _mm_unpacklo_epi32(c0, c1);
+					__m128i t1 = _mm_unpacklo_epi32(c2, c3);
+					__m128i t2 = _mm_unpackhi_epi32(c0, c1);
+					__m128i t3 = _mm_unpackhi_epi32(c2, c3);
+					_mm_storeu_si128((__m128i *)&dst[x + (y + 0) * width], _mm_unpacklo_epi64(t0, t1));
+					_mm_storeu_si128((__m128i *)&dst[x + (y + 1) * width], _mm_unpackhi_epi64(t0, t1));
+					_mm_storeu_si128((__m128i *)&dst[x + (y + 2) * width], _mm_unpacklo_epi64(t2, t3));
+					_mm_storeu_si128((__m128i *)&dst[x + (y + 3) * width], _mm_unpackhi_epi64(t2, t3));
+				}
+				for (; x < ex; ++x)
+					for (int yy = y; yy < y + 4; ++yy)
+						dst[x + yy * width] = src[yy + x * height];
+			}
+#endif
+			for (; y < ey; ++y)
+				for (int x = bx; x < ex; ++x)
+					dst[x + y * width] = src[y + x * height];
+		}
+	}
+}
+void expandIndices(unsigned int *dst, const unsigned char *src, int width, int height)
+{
+	// Palette lookup to row-major RGBA, in bands of 16 rows when the indices are column-major.
+	const unsigned int *colors = (const unsigned int *)palette.colors;
+	if (!columnMajor)
+	{
+		for (int i = 0; i < width * height; ++i)
+			dst[i] = colors[src[i]];
+		return;
+	}
+	for (int by = 0; by < height; by += 16)
+	{
+		int ey = by + 16 < height ? by + 16 : height;
+		for (int x = 0; x < width; ++x)
+			for (int y = by; y < ey; ++y)
+				dst[x + y * width] = colors[src[y + x * height]];
+	}
+}
+
+void copyPixelBuffer(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	unsigned char *ptr = dst;
+	for (size_t i = 0; i < size; ++i)
+	{
+		*ptr = src[i];
+		++ptr;
+	}
+}
+
+void loadScene()
+{
+	// Binary levels are recognised by their magic, anything else is read as text.
+	size_t size;
+	const unsigned char *data = mapFile(level_path, &size);
+	if (data == NULL) { printf("Error opening level."); return; }
+	bool binary = size >= sizeof(LevelHeader) && memcmp(data, "PRLV", 4) == 0;
+	bool loaded = binary ? readBinaryLevel(data, size, level_path) : readTextLevel(level_path);
+	if (loaded)
+		levelHash = levelFileHash(data, size);
+	if (data != chunks.level) // Chunked levels stay mapped for the loader.
+		unmapFile(data, size);
+	if (!loaded)
+		return;
+	levelGeneration++;
+	prepareLevel();
+}
+void prepareLevel()
+{
+	// Textures the level names but that aren't loaded draw as texture 0.
+	for (int s = 0; s < sectorCount; ++s)
+		if (sectors[s].st < 0 || sectors[s].st >= textureCount) { sectors[s].st = 0; }
+	for (int w = 0; w < wallCount; ++w)
+		if (walls[w].wt < 0 || walls[w].wt >= textureCount) { walls[w].wt = 0; }
+
+	// Shade the level's wall textures before the first frame needs them.
+	for (int w = 0; w < wallCount; ++w)
+		shadedTexture(walls[w].wt, walls[w].shade);
+	if (residency.enabled)
+		buildPrefetchLists();
+}
+bool readTextLevel(const char *path)
+{
+	LevelSector *levelSectors;
+	LevelWall *levelWalls;
+	unsigned int levelSectorCount, levelWallCount;
+	Player start;
+	if (!parseTextLevel(path, &levelSectors, &levelSectorCount, &levelWalls, &levelWallCount, &start))
+		return false;
+
+	bool fits = levelSectorCount <= sizeof(sectors) / sizeof(Sector) && levelWallCount <= sizeof(walls) / sizeof(Wall);
+	if (fits)
+		setLevel(levelSectors, levelSectorCount, levelWalls, levelWallCount, &start);
+	else
+		printf("%s has more than %zu sectors or %zu walls, convert it into a chunked level to stream it.\n", path, sizeof(sectors) / sizeof(Sector), sizeof(walls) / sizeof(Wall));
+	free(levelSectors);
+	free(levelWalls);
+	return fits;
+}
+bool parseTextLevel(const char *path, LevelSector **levelSectors, unsigned int *levelSectorCount, LevelWall **levelWalls, unsigned int *levelWallCount, Player *start)
+{
+	// Open and read file.
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) { printf("Error opening %s.\n", path); return false; }
+
+	// Load Scene.
+	unsigned int sectorTotal = 0, wallTotal = 0;
+	fscanf(fp, "%u", &sectorTotal);				// Number of sectors.
+	LevelSector *sectorRecords = (LevelSector *)calloc(sectorTotal + 1, sizeof(LevelSector));
+	for (unsigned int s = 0; sectorRecords && s < sectorTotal; s++)	// Loop through sectors.
+	{
+		LevelSector *sector = &sectorRecords[s];
+		fscanf(fp, "%i %i %i %i %i %i", &sector->ws, &sector->we, &sector->z1, &sector->z2, &sector->st, &sector->ss);
+	}
+	fscanf(fp, "%u", &wallTotal);				// Number of walls.
+	LevelWall *wallRecords = (LevelWall *)calloc(wallTotal + 1, sizeof(LevelWall));
+	for (unsigned int w = 0; wallRecords && w < wallTotal; w++)	// Loop through walls.
+	{
+		LevelWall *wall = &wallRecords[w];
+		fscanf(fp, "%i %i %i %i %i %i %i %i", &wall->x1, &wall->y1, &wall->x2, &wall->y2, &wall->wt, &wall->u, &wall->v, &wall->shade);
+	}
+	// Load player properties.
+	*start = (Player){ 0 };
+	fscanf(fp, "%i %i %i %i %i", &start->x, &start->y, &start->z, &start->angle, &start->look);
+
+	// Close file.
+	fclose(fp);
+	if (sectorRecords == NULL || wallRecords == NULL)
+	{
+		printf("%s lists more sectors or walls than fit in memory.\n", path);
+		free(sectorRecords);
+		free(wallRecords);
+		return false;
+	}
+	*levelSectors = sectorRecords;
+	*levelSectorCount = sectorTotal;
+	*levelWalls = wallRecords;
+	*levelWallCount = wallTotal;
+	return true;
+}
+void setLevel(const LevelSector *levelSectors, unsigned int levelSectorCount, const LevelWall *levelWalls, unsigned int levelWallCount, const Player *start)
+{
+	// A whole level, replacing the current one and any chunks streaming in for it.
+	stopChunkStreaming();
+	sectorCount = levelSectorCount;
+	for (int s = 0; s < sectorCount; ++s)
+		sectors[s] = sectorFromRecord(&levelSectors[s]);
+	wallCount = levelWallCount;
+	for (int w = 0; w < wallCount; ++w)
+		walls[w] = wallFromRecord(&levelWalls[w]);
+	player = *start;
+}
+Sector sectorFromRecord(const LevelSector *record)
+{
+	Sector sector = { record->ws, record->we, record->z1, record->z2 };
+	sector.st = record->st;
+	sector.ss = record->ss;
+	return sector;
+}
+Wall wallFromRecord(const LevelWall *record)
+{
+	return (Wall){ record->x1, record->y1, record->x2, record->y2, 0, record->wt, record->u, record->v, record->shade };
+}
+bool readBinaryLevel(const unsigned char *data, size_t size, const char *path)
+{
+	// Everything is checked before the level is touched, a bad file leaves the current level loaded.
+	// Chunk contents are checked by the loader as they stream in, so a chunked level isn't read whole.
+	const LevelHeader *header = (const LevelHeader *)data;
+	const LevelSection *table = (const LevelSection *)(data + sizeof(LevelHeader));
+	bool valid = header->version == 1 && header->sectionCount > 0 &&
+		header->sectionCount <= (size - sizeof(LevelHeader)) / sizeof(LevelSection) &&
+		header->checksum == hashBytes(table, header->sectionCount * sizeof(LevelSection));
+
+	const LevelSector *levelSectors = NULL;
+	const LevelWall *levelWalls = NULL;
+	const Player *start = NULL;
+	const LevelChunkGrid *grid = NULL;
+	const LevelSection *chunkData = NULL;
+	unsigned int levelSectorCount = 0, levelWallCount = 0;
+	for (int i = 0; valid && i < header->sectionCount; ++i)
+	{
+		const LevelSection *section = &table[i];
+		const unsigned char *bytes = data + section->offset;
+		bool streamed = memcmp(section->id, "CDAT", 4) == 0;
+		valid = section->offset % 4 == 0 && section->offset <= size && section->size <= size - section->offset &&
+			(streamed || section->checksum == hashBytes(bytes, section->size));
+		if (valid && memcmp(section->id, "SECT", 4) == 0)
+		{
+			levelSectors = (const LevelSector *)bytes;
+			levelSectorCount = section->size / sizeof(LevelSector);
+			valid = section->size % sizeof(LevelSector) == 0;
+		}
+		else if (valid && memcmp(section->id, "WALL", 4) == 0)
+		{
+			levelWalls = (const LevelWall *)bytes;
+			levelWallCount = section->size / sizeof(LevelWall);
+			valid = section->size % sizeof(LevelWall) == 0;
+		}
+		else if (valid && memcmp(section->id, "PLYR", 4) == 0)
+		{
+			start = (const Player *)bytes;
+			valid = section->size == sizeof(Player);
+		}
+		else if (valid && memcmp(section->id, "CHNK", 4) == 0)
+		{
+			grid = (const LevelChunkGrid *)bytes;
+			valid = section->size >= sizeof(LevelChunkGrid) && grid->size > 0 &&
+				grid->columns > 0 && grid->columns <= 65536 && grid->rows > 0 && grid->rows <= 65536 &&
+				section->size == sizeof(LevelChunkGrid) + (size_t)grid->columns * grid->rows * sizeof(LevelChunk);
+		}
+		else if (valid && streamed)
+			chunkData = section;
+	}
+
+	// Chunked levels start out empty around the player, and fill in as the loader publishes chunks.
+	if (valid && grid && chunkData && start)
+	{
+		if (!startChunkStreaming(data, size, grid, data + chunkData->offset, chunkData->size, start))
+		{
+			printf("Chunk loader thread could not be started.\n");
+			return false;
+		}
+		sectorCount = 0;
+		wallCount = 0;
+		player = *start;
+		return true;
+	}
+
+	valid = valid && levelSectors && levelWalls && start &&
+		levelSectorCount <= sizeof(sectors) / sizeof(Sector) && levelWallCount <= sizeof(walls) / sizeof(Wall);
+	for (unsigned int s = 0; valid && s < levelSectorCount; ++s)
+		valid = levelSectors[s].ws >= 0 && levelSectors[s].ws < levelSectors[s].we && levelSectors[s].we <= (int)levelWallCount;
+	if (!valid)
+	{
+		printf("%s is not a valid binary level.\n", path);
+		return false;
+	}
+	setLevel(levelSectors, levelSectorCount, levelWalls, levelWallCount, start);
+	return true;
+}
+bool writeBinaryLevel(const char *path, const LevelSector *levelSectors, unsigned int levelSectorCount, const LevelWall *levelWalls, unsigned int levelWallCount, const Player *start, int chunkSize)
+{
+	// Sections in the order the text format lists them, or with a chunk size the sectors sorted into a grid of
+	// chunks, each chunk's sectors followed by their walls.
+	LevelSection table[3] = { 0 };
+	const void *contents[3];
+	unsigned char *chunkTable = NULL, *chunkData = NULL;
+	int chunkCount = 0;
+	if (chunkSize <= 0)
+	{
+		table[0] = (LevelSection){ { 'S', 'E', 'C', 'T' }, 0, levelSectorCount * sizeof(LevelSector) };
+		table[1] = (LevelSection){ { 'W', 'A', 'L', 'L' }, 0, levelWallCount * sizeof(LevelWall) };
+		contents[0] = levelSectors;
+		contents[1] = levelWalls;
+	}
+	else
+	{
+		// Each sector goes in the chunk the centre of its walls' bounds falls in.
+		int *centers = (int *)malloc((levelSectorCount + 1) * 2 * sizeof(int));
+		LevelChunkGrid grid = { chunkSize };
+		int maxX = 0, maxY = 0;
+		for (unsigned int s = 0; s < levelSectorCount; ++s)
+		{
+			const LevelSector *sector = &levelSectors[s];
+			if (sector->ws < 0 || sector->ws >= sector->we || sector->we > (int)levelWallCount)
+			{
+				printf("Sector %u's walls are outside the level.\n", s);
+				free(centers);
+				return false;
+			}
+			int x1 = levelWalls[sector->ws].x1, x2 = x1, y1 = levelWalls[sector->ws].y1, y2 = y1;
+			for (int w = sector->ws; w < sector->we; ++w)
+			{
+				const LevelWall *wall = &levelWalls[w];
+				int lowX = wall->x1 < wall->x2 ? wall->x1 : wall->x2, highX = wall->x1 < wall->x2 ? wall->x2 : wall->x1;
+				int lowY = wall->y1 < wall->y2 ? wall->y1 : wall->y2, highY = wall->y1 < wall->y2 ? wall->y2 : wall->y1;
+				if (lowX < x1) { x1 = lowX; }
+				if (highX > x2) { x2 = highX; }
+				if (lowY < y1) { y1 = lowY; }
+				if (highY > y2) { y2 = highY; }
+			}
+			centers[s * 2] = (x1 + x2) / 2;
+			centers[s * 2 + 1] = (y1 + y2) / 2;
+			if (s == 0 || centers[s * 2] < grid.x) { grid.x = centers[s * 2]; }
+			if (s == 0 || centers[s * 2 + 1] < grid.y) { grid.y = centers[s * 2 + 1]; }
+			if (s == 0 || centers[s * 2] > maxX) { maxX = centers[s * 2]; }
+			if (s == 0 || centers[s * 2 + 1] > maxY) { maxY = centers[s * 2 + 1]; }
+		}
+		grid.columns = (maxX - grid.x) / chunkSize + 1;
+		grid.rows = (maxY - grid.y) / chunkSize + 1;
+		chunkCount = grid.columns * grid.rows;
+
+		// Count each chunk's records, then lay the chunks out one after another.
+		size_t tableSize = sizeof(LevelChunkGrid) + chunkCount * sizeof(LevelChunk);
+		chunkTable = (unsigned char *)calloc(tableSize, 1);
+		LevelChunk *directory = (LevelChunk *)(chunkTable + sizeof(LevelChunkGrid));
+		memcpy(chunkTable, &grid, sizeof(LevelChunkGrid));
+		for (unsigned int s = 0; s < levelSectorCount; ++s)
+		{
+			LevelChunk *chunk = &directory[(centers[s * 2 + 1] - grid.y) / chunkSize * grid.columns + (centers[s * 2] - grid.x) / chunkSize];
+			chunk->sectorCount++;
+			chunk->wallCount += levelSectors[s].we - levelSectors[s].ws;
+		}
+		unsigned int dataSize = 0;
+		for (int c = 0; c < chunkCount; ++c)
+		{
+			if (directory[c].sectorCount > sizeof(sectors) / sizeof(Sector) || directory[c].wallCount > sizeof(walls) / sizeof(Wall))
+			{
+				printf("Chunk %i has %u sectors and %u walls, more than can be drawn, use a smaller chunk size.\n", c, directory[c].sectorCount, directory[c].wallCount);
+				free(centers);
+				free(chunkTable);
+				return false;
+			}
+			directory[c].offset = dataSize;
+			dataSize += directory[c].sectorCount * sizeof(LevelSector) + directory[c].wallCount * sizeof(LevelWall);
+		}
+
+		// Sectors keep their order within a chunk, with their walls numbered from the chunk's first wall.
+		chunkData = (unsigned char *)malloc(dataSize + 1);
+		unsigned int *sectorsWritten = (unsigned int *)calloc(chunkCount, sizeof(unsigned int));
+		unsigned int *wallsWritten = (unsigned int *)calloc(chunkCount, sizeof(unsigned int));
+		for (unsigned int s = 0; s < levelSectorCount; ++s)
+		{
+			int c = (centers[s * 2 + 1] - grid.y) / chunkSize * grid.columns + (centers[s * 2] - grid.x) / chunkSize;
+			LevelSector *sector = (LevelSector *)(chunkData + directory[c].offset) + sectorsWritten[c]++;
+			LevelWall *chunkWalls = (LevelWall *)(chunkData + directory[c].offset + directory[c].sectorCount * sizeof(LevelSector));
+			int wallTotal = levelSectors[s].we - levelSectors[s].ws;
+			*sector = levelSectors[s];
+			sector->ws = wallsWritten[c];
+			sector->we = wallsWritten[c] + wallTotal;
+			memcpy(chunkWalls + wallsWritten[c], levelWalls + levelSectors[s].ws, wallTotal * sizeof(LevelWall));
+			wallsWritten[c] += wallTotal;
+		}
+		for (int c = 0; c < chunkCount; ++c)
+			directory[c].checksum = hashBytes(chunkData + directory[c].offset, directory[c].sectorCount * sizeof(LevelSector) + directory[c].wallCount * sizeof(LevelWall));
+		free(centers);
+		free(sectorsWritten);
+		free(wallsWritten);
+
+		table[0] = (LevelSection){ { 'C', 'H', 'N', 'K' }, 0, tableSize };
+		table[1] = (LevelSection){ { 'C', 'D', 'A', 'T' }, 0, dataSize };
+		contents[0] = chunkTable;
+		contents[1] = chunkData;
+	}
+	table[2] = (LevelSection){ { 'P', 'L', 'Y', 'R' }, 0, sizeof(Player) };
+	contents[2] = start;
+
+	// Records are whole 32-bit fields, so every section stays 4 byte aligned.
+	unsigned int offset = sizeof(LevelHeader) + sizeof(table);
+	for (int i = 0; i < 3; ++i)
+	{
+		table[i].offset = offset;
+		table[i].checksum = hashBytes(contents[i], table[i].size);
+		offset += table[i].size;
+	}
+	LevelHeader header = { { 'P', 'R', 'L', 'V' }, 1, 3, hashBytes(table, sizeof(table)) };
+
+	FILE *fp = fopen(path, "wb");
+	if (fp)
+	{
+		fwrite(&header, sizeof(LevelHeader), 1, fp);
+		fwrite(table, sizeof(table), 1, fp);
+		for (int i = 0; i < 3; ++i)
+			fwrite(contents[i], 1, table[i].size, fp);
+		fclose(fp);
+	}
+	else
+		printf("Error opening %s.\n", path);
+	free(chunkTable);
+	free(chunkData);
+	return fp != NULL;
+}
+int convertLevel(const char *textPath, const char *binaryPath, int chunkSize)
+{
+	LevelSector *levelSectors;
+	LevelWall *levelWalls;
+	unsigned int levelSectorCount, levelWallCount;
+	Player start;
+	if (!parseTextLevel(textPath, &levelSectors, &levelSectorCount, &levelWalls, &levelWallCount, &start))
+		return 1;
+
+	bool written = false;
+	if (chunkSize <= 0 && (levelSectorCount > sizeof(sectors) / sizeof(Sector) || levelWallCount > sizeof(walls) / sizeof(Wall)))
+		printf("%s has more than %zu sectors or %zu walls, give a chunk size to stream it.\n", textPath, sizeof(sectors) / sizeof(Sector), sizeof(walls) / sizeof(Wall));
+	else
+		written = writeBinaryLevel(binaryPath, levelSectors, levelSectorCount, levelWalls, levelWallCount, &start, chunkSize);
+	if (written)
+		printf("Converted %s into %s, %u sectors and %u walls%s.\n", textPath, binaryPath, levelSectorCount, levelWallCount, chunkSize > 0 ? " in chunks" : "");
+	free(levelSectors);
+	free(levelWalls);
+	return written ? 0 : 1;
+}
+bool startChunkStreaming(const unsigned char *level, size_t size, const LevelChunkGrid *grid, const unsigned char *data, size_t dataSize, const Player *start)
+{
+	// The current level's loader is only paused until the new one is running, so a failed start leaves it streaming.
+	ChunkStreamer previous = chunks;
+	if (previous.enabled)
+	{
+		chunks.stop = true;
+		raiseSignal(chunks.wake);
+		joinThread(chunks.loader);
+	}
+	else if (!createSignal(&chunks.wake))
+		return false; // The new loader takes over the paused one's signal.
+
+	int chunkCount = grid->columns * grid->rows;
+	chunks.level = level;
+	chunks.levelSize = size;
+	chunks.grid = *grid;
+	chunks.directory = (const LevelChunk *)(grid + 1);
+	chunks.data = data;
+	chunks.dataSize = dataSize;
+	chunks.state = (volatile int *)calloc(chunkCount, sizeof(int));
+	chunks.published = (Chunk *volatile *)calloc(chunkCount, sizeof(Chunk *));
+	chunks.active = (Chunk **)calloc(chunkCount, sizeof(Chunk *));
+	chunks.assembled = false;
+	int centerX, centerY;
+	chunkPosition(start->x, start->y, &centerX, &centerY);
+	chunks.centerX = centerX;
+	chunks.centerY = centerY;
+
+	chunks.stop = false;
+	chunks.enabled = startThread(&chunks.loader, loadChunks, NULL);
+	if (!chunks.enabled)
+	{
+		free((void *)chunks.state);
+		free((void *)chunks.published);
+		free(chunks.active);
+		if (!previous.enabled)
+			destroySignal(chunks.wake);
+		chunks = previous;
+		chunks.stop = false;
+		if (previous.enabled && !startThread(&chunks.loader, loadChunks, NULL))
+		{
+			releaseChunks(&chunks); // Its chunks stay drawn as they are, they just stop streaming.
+			destroySignal(chunks.wake);
+			chunks.enabled = false;
+		}
+		return false;
+	}
+	if (previous.enabled)
+		releaseChunks(&previous);
+	return true;
+}
+void stopChunkStreaming()
+{
+	if (!chunks.enabled)
+		return;
+	chunks.stop = true;
+	raiseSignal(chunks.wake);
+	joinThread(chunks.loader);
+	destroySignal(chunks.wake);
+	chunks.enabled = false;
+	releaseChunks(&chunks);
+}
+void releaseChunks(ChunkStreamer *streamer)
+{
+	// Everything a stopped loader and the main thread held for a level.
+	for (int i = 0; i < streamer->grid.columns * streamer->grid.rows; ++i)
+	{
+		freeChunk(streamer->active[i]);
+		freeChunk(streamer->published[i]);
+	}
+	free((void *)streamer->state);
+	free((void *)streamer->published);
+	free(streamer->active);
+	streamer->state = 0;
+	streamer->published = 0;
+	streamer->active = 0;
+	unmapFile(streamer->level, streamer->levelSize);
+	streamer->level = 0;
+}
+void loadChunks(void *arg)
+{
+	// Loader thread: reads the nearest chunk within reach of the player's that isn't loaded yet.
+	traceThreadName("chunk loader");
+	int cells[CHUNK_MAX_CELLS];
+	while (!chunks.stop)
+	{
+		int count = chunksInReach(chunks.centerX, chunks.centerY, chunks.radius + chunks.prefetch, cells);
+		int next = -1;
+		for (int i = 0; i < count && next < 0; ++i)
+			if (chunks.state[cells[i]] == CHUNK_UNLOADED && chunks.directory[cells[i]].sectorCount > 0) { next = cells[i]; }
+		if (next < 0)
+		{
+			waitSignal(chunks.wake); // Until the player changes chunk.
+			continue;
+		}
+
+		traceBegin("load chunk", next);
+		chunks.state[next] = CHUNK_LOADING;
+		Chunk *chunk = readChunk(next);
+		if (chunk)
+			(void)atomicExchange(&chunks.published[next], chunk); // The main thread only ever sees it whole.
+		else
+			chunks.state[next] = CHUNK_FAILED;
+		traceEnd("load chunk");
+	}
+	traceThreadExit();
+}
+Chunk *readChunk(int index)
+{
+	// Copies a chunk's records out of the mapping, which is where its pages are read in.
+	double startTime = getTime();
+	const LevelChunk *entry = &chunks.directory[index];
+	size_t size = (size_t)entry->sectorCount * sizeof(LevelSector) + (size_t)entry->wallCount * sizeof(LevelWall);
+	const unsigned char *bytes = chunks.data + entry->offset;
+	const LevelSector *levelSectors = (const LevelSector *)bytes;
+	const LevelWall *levelWalls = (const LevelWall *)(bytes + entry->sectorCount * sizeof(LevelSector));
+	bool valid = entry->sectorCount <= sizeof(sectors) / sizeof(Sector) && entry->wallCount <= sizeof(walls) / sizeof(Wall) &&
+		entry->offset % 4 == 0 && entry->offset <= chunks.dataSize && size <= chunks.dataSize - entry->offset &&
+		hashBytes(bytes, size) == entry->checksum;
+	for (unsigned int s = 0; valid && s < entry->sectorCount; ++s)
+		valid = levelSectors[s].ws >= 0 && levelSectors[s].ws < levelSectors[s].we && levelSectors[s].we <= (int)entry->wallCount;
+	if (!valid)
+	{
+		printf("Chunk %i of %s is damaged, it won't be drawn.\n", index, level_path);
+		return NULL;
+	}
+
+	Chunk *chunk = (Chunk *)malloc(sizeof(Chunk));
+	chunk->sectorCount = entry->sectorCount;
+	chunk->wallCount = entry->wallCount;
+	chunk->sectors = (Sector *)malloc((entry->sectorCount + 1) * sizeof(Sector));
+	chunk->walls = (Wall *)malloc((entry->wallCount + 1) * sizeof(Wall));
+	for (unsigned int s = 0; s < entry->sectorCount; ++s)
+		chunk->sectors[s] = sectorFromRecord(&levelSectors[s]);
+	for (unsigned int w = 0; w < entry->wallCount; ++w)
+		chunk->walls[w] = wallFromRecord(&levelWalls[w]);
+	chunk->loadStart = startTime;
+	return chunk;
+}
+void freeChunk(Chunk *chunk)
+{
+	if (chunk == NULL)
+		return;
+	free(chunk->sectors);
+	free(chunk->walls);
+	free(chunk);
+}
+void updateChunks()
+{
+	// Take what the loader published, drop chunks left out of reach, and rebuild the drawn level when the chunks
+	// around the player change.
+	int centerX, centerY;
+	chunkPosition(player.x, player.y, &centerX, &centerY);
+	if (centerX != chunks.centerX || centerY != chunks.centerY)
+	{
+		chunks.centerX = centerX;
+		chunks.centerY = centerY;
+		raiseSignal(chunks.wake);
+	}
+
+	// Sort distances go back to the chunks, so sectors still drawn after a rebuild keep their order.
+	for (int s = 0; chunks.assembled && s < sectorCount; ++s)
+		chunks.source[sectors[s].ws]->d = sectors[s].d;
+
+	bool changed = !chunks.assembled || centerX != chunks.drawnX || centerY != chunks.drawnY;
+
+	int keep = chunks.radius + chunks.prefetch + 1; // One chunk of slack, so walking along an edge doesn't reload.
+	for (int i = 0; i < chunks.grid.columns * chunks.grid.rows; ++i)
+	{
+		int x = i % chunks.grid.columns, y = i / chunks.grid.columns;
+		bool drawn = abs(x - centerX) <= chunks.radius && abs(y - centerY) <= chunks.radius;
+		if (chunks.published[i])
+		{
+			Chunk *chunk = (Chunk *)atomicExchange(&chunks.published[i], NULL);
+			chunks.active[i] = chunk;
+			chunks.state[i] = CHUNK_ACTIVE;
+			double loadMs = (getTime() - chunk->loadStart) * 1000.0;
+			chunks.loadMs += loadMs;
+			if (loadMs > chunks.maxLoadMs) { chunks.maxLoadMs = loadMs; }
+			chunks.loads++;
+			changed |= drawn;
+		}
+		if (chunks.active[i] && (abs(x - centerX) > keep || abs(y - centerY) > keep))
+		{
+			freeChunk(chunks.active[i]);
+			chunks.active[i] = NULL;
+			chunks.state[i] = CHUNK_UNLOADED;
+			chunks.unloads++;
+		}
+	}
+	if (changed)
+		assembleChunks(centerX, centerY);
+
+	// Chunks that should be drawn but aren't, still loading or left out for lack of room.
+	int cells[CHUNK_MAX_CELLS];
+	int count = chunksInReach(centerX, centerY, chunks.radius, cells);
+	chunks.notReady = chunks.dropped;
+	for (int i = 0; i < count; ++i)
+		if (!chunks.active[cells[i]] && chunks.directory[cells[i]].sectorCount > 0) { chunks.notReady++; }
+	if (chunks.notReady > 0) { chunks.notReadyFrames++; }
+	if (chunks.notReady > chunks.maxNotReady) { chunks.maxNotReady = chunks.notReady; }
+}
+void assembleChunks(int centerX, int centerY)
+{
+	// The drawn level is the loaded chunks in the draw radius, nearest first, so far ones are left out if they don't fit.
+	int cells[CHUNK_MAX_CELLS];
+	int count = chunksInReach(centerX, centerY, chunks.radius, cells);
+	sectorCount = 0;
+	wallCount = 0;
+	chunks.dropped = 0;
+	memset(chunks.source, 0, sizeof(chunks.source));
+	for (int i = 0; i < count; ++i)
+	{
+		const Chunk *chunk = chunks.active[cells[i]];
+		if (chunk == NULL)
+			continue;
+		if (sectorCount + chunk->sectorCount > sizeof(sectors) / sizeof(Sector) || wallCount + chunk->wallCount > sizeof(walls) / sizeof(Wall))
+		{
+			chunks.dropped++;
+			continue;
+		}
+
+		for (unsigned int s = 0; s < chunk->sectorCount; ++s)
+		{
+			// Walls renumbered after the chunks before. Sectors not drawn yet get a distance so the first frame sorts them.
+			Sector *sector = &sectors[sectorCount + s];
+			*sector = chunk->sectors[s];
+			sector->ws += wallCount;
+			sector->we += wallCount;
+			chunks.source[sector->ws] = &chunk->sectors[s];
+			if (sector->d != 0)
+				continue;
+			for (int w = sector->ws; w < sector->we; ++w)
+			{
+				const Wall *wall = &chunk->walls[w - wallCount];
+				sector->d += distance(player.x, player.y, (wall->x1 + wall->x2) / 2, (wall->y1 + wall->y2) / 2);
+			}
+			sector->d /= sector->we - sector->ws;
+		}
+		memcpy(walls + wallCount, chunk->walls, chunk->wallCount * sizeof(Wall));
+		sectorCount += chunk->sectorCount;
+		wallCount += chunk->wallCount;
+	}
+	chunks.assembled = true;
+	chunks.drawnX = centerX;
+	chunks.drawnY = centerY;
+	levelGeneration++;
+	prepareLevel();
+}
+int chunksInReach(int centerX, int centerY, int reach, int *cells)
+{
+	// Chunks in the grid within reach of a chunk, ring by ring outwards from it.
+	int count = 0;
+	for (int ring = 0; ring <= reach; ++ring)
+		for (int y = centerY - ring; y <= centerY + ring; ++y)
+			for (int x = centerX - ring; x <= centerX + ring; ++x)
+			{
+				if (abs(x - centerX) != ring && abs(y - centerY) != ring)
+					continue; // Inside the ring, already listed.
+				if (x >= 0 && y >= 0 && x < chunks.grid.columns && y < chunks.grid.rows)
+					cells[count++] = y * chunks.grid.columns + x;
+			}
+	return count;
+}
+void chunkPosition(int x, int y, int *chunkX, int *chunkY)
+{
+	// Rounded down, so positions before the grid's corner land in negative chunks.
+	int dx = x - chunks.grid.x, dy = y - chunks.grid.y;
+	*chunkX = dx >= 0 ? dx / chunks.grid.size : -((chunks.grid.size - 1 - dx) / chunks.grid.size);
+	*chunkY = dy >= 0 ? dy / chunks.grid.size : -((chunks.grid.size - 1 - dy) / chunks.grid.size);
+}
+unsigned int hashLevelFile(const char *path)
+{
+	size_t size;
+	const unsigned char *data = mapFile(path, &size);
+	if (data == NULL)
+		return 0;
+	unsigned int hash = levelFileHash(data, size);
+	unmapFile(data, size);
+	return hash;
+}
+unsigned int levelFileHash(const unsigned char *data, size_t size)
+{
+	// A binary level is identified by its header's checksum of the section table, which holds every section's
+	// checksum, so a chunked level isn't read whole to hash it.
+	if (size >= sizeof(LevelHeader) && memcmp(data, "PRLV", 4) == 0)
+		return ((const LevelHeader *)data)->checksum;
+	return hashBytes(data, size);
+}
+unsigned int hashBytes(const void *data, size_t size)
+{
+	// FNV-1a.
+	const unsigned char *bytes = (const unsigned char *)data;
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+unsigned char *readFile(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	fseek(fp, 0, SEEK_END);
+	long length = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *data = length > 0 ? (unsigned char *)malloc(length) : NULL;
+	if (data && fread(data, 1, length, fp) != (size_t)length)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	*size = data ? length : 0;
+	return data;
+}
+char **listDirectory(const char *directory, int *count)
+{
+	// Names of the entries in a directory, skipping hidden ones and subdirectories where the platform says so.
+	char **names = (char **)malloc(sizeof(char *));
+	int capacity = 1;
+	*count = 0;
+#ifdef _WIN32
+	char pattern[512];
+	snprintf(pattern, sizeof(pattern), "%s\\*", directory);
+	WIN32_FIND_DATAA found;
+	HANDLE find = FindFirstFileA(pattern, &found);
+	if (find == INVALID_HANDLE_VALUE) { free(names); return NULL; }
+	do
+	{
+		const char *name = found.cFileName;
+		if (name[0] == '.' || (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			continue;
+#else
+	DIR *dir = opendir(directory);
+	if (dir == NULL) { free(names); return NULL; }
+	struct dirent *found;
+	while ((found = readdir(dir)) != NULL)
+	{
+		const char *name = found->d_name;
+		if (name[0] == '.')
+			continue;
+#endif
+		if (*count == capacity)
+		{
+			capacity *= 2;
+			names = (char **)realloc(names, capacity * sizeof(char *));
+		}
+		names[*count] = (char *)malloc(strlen(name) + 1);
+		strcpy(names[(*count)++], name);
+#ifdef _WIN32
+	} while (FindNextFileA(find, &found));
+	FindClose(find);
+#else
+	}
+	closedir(dir);
+#endif
+	return names;
+}
+const unsigned char *mapFile(const char *path, size_t *size)
+{
+	// Whole file mapped read-only, NULL if it is missing or empty.
+	void *data = NULL;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+	{
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping); // The view keeps the mapping alive.
+	}
+	CloseHandle(file);
+	*size = data ? (size_t)fileSize.QuadPart : 0;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) { data = NULL; }
+	}
+	close(fd);
+	*size = data ? (size_t)st.st_size : 0;
+#endif
+	return (const unsigned char *)data;
+}
+void unmapFile(const unsigned char *data, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void *)data, size);
+#endif
+}
+
+typedef struct
+{
+	void (*run)(void *);
+	void *arg;
+} ThreadEntry;
+#ifdef _WIN32
+DWORD WINAPI threadMain(LPVOID param)
+#else
+void *threadMain(void *param)
+#endif
+{
+	ThreadEntry entry = *(ThreadEntry *)param;
+	free(param);
+	entry.run(entry.arg);
+	return 0;
+}
+bool startThread(Thread *thread, void (*run)(void *), void *arg)
+{
+	ThreadEntry *entry = (ThreadEntry *)malloc(sizeof(ThreadEntry));
+	*entry = (ThreadEntry){ run, arg };
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, threadMain, entry, 0, NULL);
+	if (*thread == NULL) { free(entry); return false; }
+#else
+	if (pthread_create(thread, NULL, threadMain, entry) != 0) { free(entry); return false; }
+#endif
+	return true;
+}
+void joinThread(Thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+bool createSignal(Signal *signal)
+{
+	// Wakes one waiting thread, or the next one to wait if none is, so a raise is never missed.
+#ifdef _WIN32
+	*signal = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return *signal != NULL;
+#else
+	*signal = (Signal)malloc(sizeof(SignalState));
+	(*signal)->raised = false;
+	if (pthread_mutex_init(&(*signal)->mutex, NULL) != 0) { free(*signal); return false; }
+	if (pthread_cond_init(&(*signal)->cond, NULL) != 0) { pthread_mutex_destroy(&(*signal)->mutex); free(*signal); return false; }
+	return true;
+#endif
+}
+void destroySignal(Signal signal)
+{
+#ifdef _WIN32
+	CloseHandle(signal);
+#else
+	pthread_cond_destroy(&signal->cond);
+	pthread_mutex_destroy(&signal->mutex);
+	free(signal);
+#endif
+}
+void raiseSignal(Signal signal)
+{
+#ifdef _WIN32
+	SetEvent(signal);
+#else
+	pthread_mutex_lock(&signal->mutex);
+	signal->raised = true;
+	pthread_cond_signal(&signal->cond);
+	pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+void waitSignal(Signal signal)
+{
+#ifdef _WIN32
+	WaitForSingleObject(signal, INFINITE);
+#else
+	pthread_mutex_lock(&signal->mutex);
+	while (!signal->raised)
+		pthread_cond_wait(&signal->cond, &signal->mutex);
+	signal->raised = false;
+	pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+int cpuCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+bool startRecording(const char *path)
+{
+	demo.fp = fopen(path, "wb");
+	if (demo.fp == NULL) { printf("Error opening demo %s for recording.\n", path); return false; }
+
+	DemoHeader header = { { 'P', 'R', 'D', 'M' }, 1, TICK_RATE, hashLevelFile(level_path), player };
+	fwrite(&header, sizeof(DemoHeader), 1, demo.fp);
+
+	demo.recording = true;
+	demo.ticks = 0;
+	printf("Recording demo %s.\n", path);
+	return true;
+}
+bool startPlayback(const char *path, bool timedemo)
+{
+	demo.fp = fopen(path, "rb");
+	if (demo.fp == NULL) { printf("Error opening demo %s.\n", path); return false; }
+
+	DemoHeader header;
+	if (fread(&header, sizeof(DemoHeader), 1, demo.fp) != 1 || memcmp(header.magic, "PRDM", 4) != 0 || header.version != 1)
+	{
+		printf("%s is not a valid demo.\n", path);
+		fclose(demo.fp);
+		demo.fp = NULL;
+		return false;
+	}
+	if (header.tickRate != TICK_RATE)
+	{
+		printf("Demo %s was recorded at %i ticks per second, playback runs at %i.\n", path, header.tickRate, TICK_RATE);
+		fclose(demo.fp);
+		demo.fp = NULL;
+		return false;
+	}
+	if (header.levelHash != hashLevelFile(level_path))
+		printf("Warning: demo %s was recorded against a different level, playback may desync.\n", path);
+
+	player = header.start;
+	demo.playing = true;
+	demo.timedemo = timedemo;
+	demo.ticks = 0;
+	printf("Playing demo %s.\n", path);
+	return true;
+}
+void stopDemo()
+{
+	if (demo.fp)
+		fclose(demo.fp);
+	if (demo.recording)
+		printf("Recorded %u ticks.\n", demo.ticks);
+
+	demo.fp = NULL;
+	demo.recording = false;
+	demo.playing = false;
+}
+void recordDemoTick()
+{
+	// One byte per tick: 7 input bits, top bit is a level reload.
+	unsigned char bits =
+		(playerInput.w ? 1 << 0 : 0) | (playerInput.a ? 1 << 1 : 0) |
+		(playerInput.s ? 1 << 2 : 0) | (playerInput.d ? 1 << 3 : 0) |
+		(playerInput.sl ? 1 << 4 : 0) | (playerInput.sr ? 1 << 5 : 0) |
+		(playerInput.m ? 1 << 6 : 0) | (levelReloadPending ? 1 << 7 : 0);
+	fputc(bits, demo.fp);
+	demo.ticks++;
+}
+void playDemoTick()
+{
+	int bits = fgetc(demo.fp);
+	if (bits == EOF)
+	{
+		printf("Demo finished after %u ticks.\n", demo.ticks);
+		bool timedemo = demo.timedemo;
+		stopDemo();
+		demo.timedemo = timedemo;
+		playerInput = (PlayerInput){ 0 };
+		return;
+	}
+
+	playerInput.w = (bits >> 0) & 1;
+	playerInput.a = (bits >> 1) & 1;
+	playerInput.s = (bits >> 2) & 1;
+	playerInput.d = (bits >> 3) & 1;
+	playerInput.sl = (bits >> 4) & 1;
+	playerInput.sr = (bits >> 5) & 1;
+	playerInput.m = (bits >> 6) & 1;
+	levelReloadPending = (bits >> 7) & 1;
+	demo.ticks++;
+}
+
+bool viewChanged()
+{
+	// Everything the composite depends on besides the clock.
+	struct
+	{
+		Player player;
+		unsigned int levelGeneration;
+		unsigned int activeFramebuffer;
+		unsigned int sceneWidth, sceneHeight;
+		bool hud;
+		bool overdraw;
+	} state;
+	memset(&state, 0, sizeof(state)); // Zero padding so it hashes the same every time.
+	state.player = player;
+	state.levelGeneration = levelGeneration;
+	state.activeFramebuffer = activeFramebuffer;
+	state.sceneWidth = scene_width;
+	state.sceneHeight = scene_height;
+	state.hud = profiler.hud;
+	state.overdraw = overdraw.enabled;
+
+	// FNV-1a.
+	unsigned int hash = 2166136261u;
+	const unsigned char *bytes = (const unsigned char *)&state;
+	for (size_t i = 0; i < sizeof(state); ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+
+	bool changed = !renderOnChange.rendered || renderOnChange.layersDirty || hash != renderOnChange.viewHash || interlace.stale ||
+		(residency.enabled && residency.pending > 0) || // Streamed textures replace their placeholders when installed,
+		(chunks.enabled && chunks.notReady > 0);		// and chunks fill in around the player.
+	renderOnChange.rendered = true;
+	renderOnChange.layersDirty = false;
+	renderOnChange.viewHash = hash;
+	return changed;
+}
+
+void draw3D()
+{
+	profileBegin(STAGE_DRAW3D);
+
+	int cycles = 0;
+
+	// Draw 3D
+	int wx[4], wy[4], wz[4]; // World Positions
+	float CS = math.cos[player.angle]; // Player Cosine
+	float SN = math.sin[player.angle]; // Player Sine
+
+	visibleSectors = 0;
+	visibleWalls = 0;
+
+	// Sort sectors.
+	for (int s = 0; s < sectorCount; ++s)
+	{
+		for (int w = 0; w < sectorCount-s-1; ++w)
+		{
+			if (sectors[w].d < sectors[w+1].d)
+			{
+				Sector st = sectors[w];
+				sectors[w] = sectors[w+1];
+				sectors[w+1] = st;
+			}
+		}
+	}
+
+	// Draw Sectors. drawWall is timed per call, but a counter read is a syscall that costs as much as a short
+	// wall, so the counters switch stage only when the pass moves between walls and surfaces.
+	Stage counted = STAGE_COUNT;
+	for (int s = 0; s < sectorCount; ++s)
+	{
+		sectors[s].d = 0; // Clear distance.
+		overdraw.sector = s;
+		traceBegin("sector", s);
+		int sectorWalls = visibleWalls;
+
+		if		(player.z < sectors[s].z1)	{ sectors[s].surface = 1; cycles = 2; for (int x = 0; x < scene_width; ++x) { surf[x] = scene_height; } }
+		else if (player.z > sectors[s].z2)	{ sectors[s].surface = 2; cycles = 2; for (int x = 0; x < scene_width; ++x) { surf[x] = 0; } }
+		else								{ sectors[s].surface = 0; cycles = 1; }
+
+		for (int frontBack = 0; frontBack < cycles; ++frontBack)
+		{
+			for (int w = sectors[s].ws; w < sectors[s].we; ++w) // Loop through walls
+			{
+				// Offset by player.
+				int x1 = walls[w].x1 - player.x;
+				int x2 = walls[w].x2 - player.x;
+				int y1 = walls[w].y1 - player.y;
+				int y2 = walls[w].y2 - player.y;
 
 				if (frontBack == 1)
 				{
@@ -787,172 +3948,1169 @@ void draw3D()
 					clipBehindPlayer(&wx[3], &wy[3], &wz[3], wx[2], wy[2], wz[2]); // Top line.
 				}
 
+				// Pick the column step from the nearest end of the wall.
+				int nearDepth = wy[0] < wy[1] ? wy[0] : wy[1];
+				columnLOD.step = 1;
+				if (frontBack == 0 && columnLOD.distance > 0 && nearDepth >= columnLOD.distance)
+					columnLOD.step = nearDepth >= columnLOD.distance * 2 ? 4 : 2;
+
 				// Calculate Screen Positions
-				int halfBufferWidth = buffer_width / 2.0f;
-				int halfBufferHeight = buffer_height / 2.0f;
+				int halfBufferWidth = scene_width / 2.0f;
+				int halfBufferHeight = scene_height / 2.0f;
+				float scaledFov = fov * viewScale;
 
-				wx[0] = wx[0] * fov / wy[0] + halfBufferWidth;
-				wy[0] = wz[0] * fov / wy[0] + halfBufferHeight;
-				wx[1] = wx[1] * fov / wy[1] + halfBufferWidth;
-				wy[1] = wz[1] * fov / wy[1] + halfBufferHeight;
+				wx[0] = wx[0] * scaledFov / wy[0] + halfBufferWidth;
+				wy[0] = wz[0] * scaledFov / wy[0] + halfBufferHeight;
+				wx[1] = wx[1] * scaledFov / wy[1] + halfBufferWidth;
+				wy[1] = wz[1] * scaledFov / wy[1] + halfBufferHeight;
 
-				wx[2] = wx[2] * fov / wy[2] + halfBufferWidth;
-				wy[2] = wz[2] * fov / wy[2] + halfBufferHeight;
-				wx[3] = wx[3] * fov / wy[3] + halfBufferWidth;
-				wy[3] = wz[3] * fov / wy[3] + halfBufferHeight;
+				wx[2] = wx[2] * scaledFov / wy[2] + halfBufferWidth;
+				wy[2] = wz[2] * scaledFov / wy[2] + halfBufferHeight;
+				wx[3] = wx[3] * scaledFov / wy[3] + halfBufferWidth;
+				wy[3] = wz[3] * scaledFov / wy[3] + halfBufferHeight;
 
 				// Draw wall in 3D
 				RGBA c;
 				c.rgba = walls[w].c;
+				if (frontBack == 0) { visibleWalls++; }
+				if (residency.enabled) { requestTexture(frontBack == 0 ? walls[w].wt : sectors[s].st, true); }
+				Stage stage = frontBack == 0 ? STAGE_WALLS : STAGE_SURFACES;
+				if (stage != counted)
+				{
+					profileCounters(counted, stage);
+					counted = stage;
+				}
+				profileTimerBegin(stage);
+				overdraw.pass = frontBack == 0 ? PASS_WALLS : PASS_SURFACES;
 				drawWall(wx[0], wx[1], wy[0], wy[1], wy[2], wy[3], s, w, frontBack);
+				profileTimerEnd(stage);
 			}
 
 			sectors[s].d /= (sectors[s].we - sectors[s].ws); // Average sector distance.
 		}
+
+		if (visibleWalls > sectorWalls) { visibleSectors++; }
+		for (int p = 0; residency.enabled && visibleWalls > sectorWalls && p < RESIDENCY_PREFETCH && residency.prefetch[sectors[s].ws][p] >= 0; ++p)
+			requestTexture(residency.prefetch[sectors[s].ws][p], false);
+		traceEnd("sector");
+	}
+	profileCounters(counted, STAGE_COUNT);
+
+	profileEnd(STAGE_DRAW3D);
+}
+void drawWall(int x1, int x2, int b1, int b2, int t1, int t2, int s, int w, int frontBack)
+{
+	int wt = walls[w].wt; // Get wall texture.
+	const RGBA *shaded = frontBack == 0 && !palettized ? shadedTexture(wt, walls[w].shade) : NULL;
+	const TextureDescriptor *descriptor = &textureDescriptors[wt];
+	const TextureDescriptor *surfaceDescriptor = &textureDescriptors[sectors[s].st];
+	const RGBA *texels = shaded ? shaded : descriptor->texels;
+
+	// Calculate horizontal texture coordinates.
+	float ht = 0;
+	float ht_step = (float)(descriptor->levels[0].wMask + 1)*walls[w].u / (float)(x2-x1);
+
+	// 
+	int dyb = b2 - b1; // Bottom line y distance
+	int dyt = t2 - t1; // Top line y distance
+	int dx = x2 - x1; if (dx == 0) { dx = 1; } // x distance
+	int xs = x1; // Starting Position
+
+	// Clip X
+	if (x1 < 0) { ht -= ht_step * x1; x1 = 0; }
+	if (x2 < 0) { x2 = 0; }
+	if (x1 > scene_width) { x1 = scene_width; }
+	if (x2 > scene_width) { x2 = scene_width; }
+
+	// Draw vertical lines.
+	for (int x = x1; x < x2; ++x)
+	{
+		// Interlaced frames keep the other half of the columns, except LOD columns later ones repeat.
+		bool lodSample = columnLOD.step > 1 && (x - x1) % columnLOD.step == 0;
+		if (interlace.parity >= 0 && (x & 1) != interlace.parity && !lodSample)
+		{
+			ht += ht_step;
+			continue;
+		}
+
+		int y1 = dyb * (x - xs + 0.5f) / dx + b1; // Bottom point on y axis
+		int y2 = dyt * (x - xs + 0.5f) / dx + t1; // Top point on y axis
+
+		// Calculate vertical texture coordinates.
+		float vt = 0;
+		float vt_step = (float)(descriptor->levels[0].hMask + 1) * walls[w].v / (float)(y2 - y1);
+
+		// Clip Y
+		if (y1 < 0) { vt -= vt_step * y1; y1 = 0; }
+		if (y2 < 0) { y2 = 0; }
+		if (y1 > scene_height) { y1 = scene_height; }
+		if (y2 > scene_height) { y2 = scene_height; }
+
+		// Draw front wall
+		if (frontBack == 0)
+		{
+			if (y2 > y1) { profiler.pixels[STAGE_WALLS] += y2 - y1; }
+
+			if (sectors[s].surface == 1) { surf[x] = y1; } // Bottom surface top row
+			if (sectors[s].surface == 2) { surf[x] = y2; } // Top Surface top row
+
+			// Far columns step through several texels per pixel, so sample the mip level that steps about one.
+			int mip = mipmapping ? mipLevel(descriptor, ht_step > vt_step ? ht_step : vt_step) : 0;
+			const TextureLevel level = descriptor->levels[mip];
+			int columnOffset = level.offset + ((((int)ht >> mip) & level.wMask) << level.hShift);
+
+			// Far walls: repeat the last sampled column until the next one is due.
+			if (columnLOD.step > 1 && !lodSample)
+			{
+				if (columnLOD.y2 > columnLOD.y1)
+				{
+					for (int y = y1; y < y2; ++y)
+					{
+						int source = y < columnLOD.y1 ? columnLOD.y1 : y >= columnLOD.y2 ? columnLOD.y2 - 1 : y;
+						if (palettized)
+							drawSceneIndex(x, y, columnLOD.column[source]);
+						else
+							drawScenePixel(x, y, (RGBA){ .rgba = columnLOD.column[source] });
+					}
+				}
+				ht += ht_step;
+				continue;
+			}
+			if (palettized)
+			{
+				// Palette indices: the shade is a colormap row and the texel a byte, stepped in 16.16 fixed point.
+				int light = walls[w].shade / 2;
+				if (light < 0) { light = 0; }
+				if (light > PALETTE_LIGHT_LEVELS - 1) { light = PALETTE_LIGHT_LEVELS - 1; }
+				const unsigned char *colormap = palette.colormap[light];
+				const unsigned char *column = descriptor->indices + columnOffset;
+				int vtFixed = vt * 65536.0f;
+				int vtStepFixed = vt_step * 65536.0f;
+				for (int y = y1; y < y2; ++y)
+				{
+					unsigned char index = colormap[column[(vtFixed >> (16 + mip)) & level.hMask]];
+					if (lodSample) { columnLOD.column[y] = index; }
+					drawSceneIndex(x, y, index);
+					vtFixed += vtStepFixed;
+				}
+				if (lodSample) { columnLOD.y1 = y1; columnLOD.y2 = y2; }
+				ht += ht_step;
+				continue;
+			}
+			if (lodSample)
+			{
+				// Sampled far column, in 16.16 fixed point with an 8-bit shade unless the shaded texture is cached.
+				int vtFixed = vt * 65536.0f;
+				int vtStepFixed = vt_step * 65536.0f;
+				int shade = 256 - (walls[w].shade / 2) * 256 / 100; if (shade < 0) { shade = 0; }
+				const RGBA *column = texels + columnOffset;
+				for (int y = y1; y < y2; ++y)
+				{
+					RGBA texel = column[(vtFixed >> (16 + mip)) & level.hMask];
+					RGBA color = shaded ? texel : (RGBA){ (texel.r * shade) >> 8, (texel.g * shade) >> 8, (texel.b * shade) >> 8, 0xff };
+					columnLOD.column[y] = color.rgba;
+					drawScenePixel(x, y, color);
+					vtFixed += vtStepFixed;
+				}
+				columnLOD.y1 = y1;
+				columnLOD.y2 = y2;
+				ht += ht_step;
+				continue;
+			}
+
+			// Walls walk down one texture column, a straight copy when the shaded texture is cached.
+			if (shaded)
+			{
+				const RGBA *column = texels + columnOffset;
+				for (int y = y1; y < y2; ++y)
+				{
+					drawScenePixel(x, y, column[((int)vt >> mip) & level.hMask]);
+					vt += vt_step;
+				}
+				ht += ht_step;
+				continue;
+			}
+			const RGBA *column = texels + columnOffset;
+			float shade = 1 - ((walls[w].shade / 2) * 0.01f);
+			for (int y = y1; y < y2; ++y)
+			{
+				int r, g, b, a;
+
+				RGBA texel = column[((int)vt >> mip) & level.hMask];
+				r = texel.r * shade;
+				g = texel.g * shade;
+				b = texel.b * shade;
+				a = 0xff;
+
+				if (r < 0) { r = 0; }
+				if (g < 0) { g = 0; }
+				if (b < 0) { b = 0; }
+
+				drawScenePixel(x, y, (RGBA){ r, g, b, a });
+
+				vt += vt_step;
+			}
+			ht += ht_step;
+		}
+		// Draw back wall and surfaces
+		if (frontBack == 1)
+		{
+			int xo = scene_width / 2;
+			int yo = scene_height / 2;
+			int x2 = x - xo;
+			int wo;
+
+			float tile = sectors[s].ss * 3;
+
+			if (sectors[s].surface == 1) { y2 = surf[x]; wo = sectors[s].z1; }
+			if (sectors[s].surface == 2) { y1 = surf[x]; wo = sectors[s].z2; }
+
+			float lookUpDown = -player.look * (M_PI * 2) * viewScale;
+			if (lookUpDown > scene_height) { lookUpDown = scene_height; }
+
+			float moveUpDown = (float)(player.z - wo) / (float)(base_height / 2);
+			if (moveUpDown == 0) { moveUpDown == 0.001f; }
+
+			int ys = y1-yo;
+			int ye = y2-yo;
+			if (ye > ys) { profiler.pixels[STAGE_SURFACES] += ye - ys; }
+
+			for (int y = ys; y < ye; ++y)
+			{
+				float z = y + lookUpDown;
+				if (z == 0) { z = 0.0001f; }
+
+				float fx = x2 / z * moveUpDown * tile;
+				float fy = fov * viewScale / z * moveUpDown * tile;
+
+				float rx = fx * math.sin[player.angle] - fy * math.cos[player.angle] + (player.y / 60 * tile);
+				float ry = fx * math.cos[player.angle] + fy * math.sin[player.angle] - (player.x / 60 * tile);
+
+				if (rx < 0) { rx = -rx + 1; }
+				if (ry < 0) { ry = -ry + 1; }
+
+				// The row's texel steps across (per column) and down (per row) pick its mip level.
+				int mip = 0;
+				if (mipmapping)
+				{
+					float across = fabsf(moveUpDown * tile / z);
+					float down = fabsf(fov * viewScale * moveUpDown * tile / (z * z));
+					mip = mipLevel(surfaceDescriptor, across > down ? across : down);
+				}
+				const TextureLevel level = surfaceDescriptor->levels[mip];
+				int texel = level.offset + (((int)ry >> mip) & level.hMask) + ((((int)rx >> mip) & level.wMask) << level.hShift);
+
+				if (palettized)
+					drawSceneIndex(x2+xo, y+yo, surfaceDescriptor->indices[texel]);
+				else if (swizzleSurfaces && surfaceDescriptor->swizzled && mip == 0)
+					drawScenePixel(x2+xo, y+yo, surfaceDescriptor->swizzled[swizzledIndex(surfaceDescriptor, (int)rx, (int)ry)]);
+				else
+					drawScenePixel(x2+xo, y+yo, surfaceDescriptor->texels[texel]);
+			}
+		}
+	}
+}
+void clipBehindPlayer(int *x1, int *y1, int *z1, int x2, int y2, int z2)
+{
+	float da = *y1;
+	float db = y2;
+	float d = da - db; if (d == 0) { d = 1; }
+	float s = da / (da-db);
+	*x1 = *x1 + s * (x2 - (*x1));
+	*y1 = *y1 + s * (y2 - (*y1)); if (*y1 == 0) { *y1 = 1; }
+	*z1 = *z1 + s * (z2 - (*z1));
+}
+int distance(int x1, int y1, int x2, int y2)
+{
+	int dist = sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
+	return dist;
+}
+
+double getTime()
+{
+	// High resolution time in seconds, usable without a window.
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void profileBegin(Stage stage)
+{
+	traceBegin(stageNames[stage], -1);
+	profileCounters(STAGE_COUNT, stage);
+	profiler.start[stage] = getTime();
+}
+void profileEnd(Stage stage)
+{
+	profiler.current[stage] += (getTime() - profiler.start[stage]) * 1000.0;
+	profileCounters(stage, STAGE_COUNT);
+	traceEnd(stageNames[stage]);
+}
+void profileTimerBegin(Stage stage)
+{
+	// Time a stage without reading the counters, for stages entered too often for a read each time.
+	traceBegin(stageNames[stage], -1);
+	profiler.start[stage] = getTime();
+}
+void profileTimerEnd(Stage stage)
+{
+	profiler.current[stage] += (getTime() - profiler.start[stage]) * 1000.0;
+	traceEnd(stageNames[stage]);
+}
+void profileCounters(Stage from, Stage to)
+{
+	// One counter read ends one stage's counting and starts the next's, STAGE_COUNT for neither.
+	if (!perfCounters.enabled)
+		return;
+	unsigned long long now[COUNTER_COUNT];
+	readPerfCounters(now);
+	for (int i = 0; from != STAGE_COUNT && i < COUNTER_COUNT; ++i)
+		perfCounters.totals[from][i] += now[i] - perfCounters.start[from][i];
+	if (to != STAGE_COUNT)
+		memcpy(perfCounters.start[to], now, sizeof(now));
+}
+void profileEndFrame()
+{
+	// Push this frame into the ring buffer and start a new one.
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		profiler.history[profiler.frame][i] = profiler.current[i];
+		profiler.current[i] = 0.0;
+	}
+
+	profiler.frame = (profiler.frame + 1) % PROFILE_HISTORY;
+	if (profiler.frameCount < PROFILE_HISTORY)
+		profiler.frameCount++;
+
+	// Whole-buffer stages touch every pixel once.
+	profiler.pixels[STAGE_DRAW3D] = profiler.pixels[STAGE_WALLS] + profiler.pixels[STAGE_SURFACES];
+	profiler.pixels[STAGE_COMBINE] += buffer_width * buffer_height;
+	profiler.pixels[STAGE_UPLOAD] += buffer_width * buffer_height;
+	perfCounters.frames++;
+}
+void drawProfilerHUD(unsigned char *framebuffer)
+{
+	// One row per stage: color key, last frame ms, rolling average ms.
+	const RGBA stageColors[STAGE_COUNT] = { YELLOW, GREEN, CYAN, BROWN, DARK_GREEN, DARK_CYAN };
+	const RGBA backing = { 0x00, 0x00, 0x00, 0xC0 };
+	const RGBA textColor = { 0xff, 0xff, 0xff, 0xff };
+	const int rowHeight = 7;
+	const int hudWidth = 58;
+	const int hudHeight = STAGE_COUNT * rowHeight + 1;
+	const int hudX = buffer_width - hudWidth;
+	const int hudY = buffer_height - hudHeight;
+
+	for (int y = hudY; y < hudY + hudHeight; ++y)
+		for (int x = hudX; x < hudX + hudWidth; ++x)
+			drawPixel(framebuffer, x, y, backing);
+
+	if (profiler.frameCount == 0)
+		return;
+
+	unsigned int last = (profiler.frame + PROFILE_HISTORY - 1) % PROFILE_HISTORY;
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		double average = 0.0;
+		for (unsigned int f = 0; f < profiler.frameCount; ++f)
+			average += profiler.history[f][i];
+		average /= profiler.frameCount;
+
+		int y = hudY + hudHeight - (i + 1) * rowHeight; // Top row is the first stage.
+		for (int sy = 0; sy < 5; ++sy)
+			for (int sx = 0; sx < 3; ++sx)
+				drawPixel(framebuffer, hudX + 1 + sx, y + sy, stageColors[i]);
+
+		drawNumber(framebuffer, hudX + 6, y, profiler.history[last][i], textColor);
+		drawNumber(framebuffer, hudX + 32, y, average, textColor);
+	}
+}
+void startTrace(const char *path)
+{
+	trace.path = path;
+	trace.start = getTime();
+	trace.enabled = true;
+	traceThreadName("main");
+	printf("Tracing to %s, press F3 to write.\n", path);
+}
+void traceEvent(const char *name, int arg, char phase)
+{
+	// Events go into a buffer owned by the calling thread, taken over from an exited thread or created on its first event.
+	if (traceBuffer == NULL)
+	{
+		if (traceUnregistered)
+			return;
+		long threadCount = trace.threadCount < TRACE_MAX_THREADS ? trace.threadCount : TRACE_MAX_THREADS;
+		for (long t = 0; t < threadCount && traceBuffer == NULL; ++t)
+			if (trace.threads[t].released && atomicCompareExchange(&trace.threads[t].released, 1, 0)) { traceBuffer = &trace.threads[t]; }
+		if (traceBuffer == NULL)
+		{
+			long slot = atomicFetchAdd(&trace.threadCount, 1);
+			TraceEvent *events = slot < TRACE_MAX_THREADS ? (TraceEvent *)malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent)) : NULL;
+			if (events == NULL)
+			{
+				traceUnregistered = true;
+				return;
+			}
+			trace.threads[slot].events = events;
+			traceBuffer = &trace.threads[slot];
+		}
+	}
+
+	if (traceBuffer->count >= TRACE_MAX_EVENTS)
+	{
+		traceBuffer->dropped++;
+		return;
+	}
+
+	TraceEvent *event = &traceBuffer->events[traceBuffer->count];
+	event->name = name;
+	event->ts = (getTime() - trace.start) * 1e6;
+	event->arg = arg;
+	event->phase = phase;
+	atomicFence(); // writeTrace() may read the buffer up to count from another thread.
+	traceBuffer->count++;
+}
+void traceBegin(const char *name, int arg)
+{
+	if (trace.enabled)
+		traceEvent(name, arg, 'B');
+}
+void traceEnd(const char *name)
+{
+	if (trace.enabled)
+		traceEvent(name, -1, 'E');
+}
+void traceThreadName(const char *name)
+{
+	if (!trace.enabled)
+		return;
+	traceEvent(name, -1, 'M');
+}
+void traceThreadExit()
+{
+	// Hands the thread's buffer to the next thread that traces, so restarted loaders don't use up the buffers.
+	if (traceBuffer == NULL)
+		return;
+	atomicFence();
+	traceBuffer->released = 1;
+	traceBuffer = NULL;
+}
+void writeTrace()
+{
+	FILE *fp = fopen(trace.path, "w");
+	if (fp == NULL) { printf("Error opening trace %s.\n", trace.path); return; }
+
+	// Chrome trace event format, loads in chrome://tracing and Perfetto.
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	long threadCount = trace.threadCount < TRACE_MAX_THREADS ? trace.threadCount : TRACE_MAX_THREADS;
+	for (long t = 0; t < threadCount; ++t)
+	{
+		TraceBuffer *buffer = &trace.threads[t];
+		unsigned int count = buffer->count; // Other threads may still be appending.
+		atomicFence();
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			TraceEvent *event = &buffer->events[i];
+			fprintf(fp, first ? "" : ",\n");
+			first = false;
+
+			if (event->phase == 'M')
+				fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%li,\"args\":{\"name\":\"%s\"}}",
+					t, event->name);
+			else if (event->arg >= 0)
+				fprintf(fp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%li,\"args\":{\"index\":%i}}",
+					event->name, event->phase, event->ts, t, event->arg);
+			else
+				fprintf(fp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%li}",
+					event->name, event->phase, event->ts, t);
+		}
+		if (buffer->dropped)
+			printf("Trace buffer of thread %li was full, %u events dropped.\n", t, buffer->dropped);
+	}
+	fprintf(fp, "\n]}\n");
+
+	fclose(fp);
+	printf("Wrote trace %s.\n", trace.path);
+}
+void stopTrace()
+{
+	if (!trace.enabled)
+		return;
+
+	writeTrace();
+	trace.enabled = false;
+	for (int t = 0; t < TRACE_MAX_THREADS; ++t)
+	{
+		free(trace.threads[t].events);
+		trace.threads[t].events = NULL;
+	}
+}
+
+#ifdef __linux__
+int openPerfCounter(unsigned int type, unsigned long long config, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group == -1; // Leader starts the whole group.
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+bool startPerfCounters()
+{
+	for (int i = 0; i < COUNTER_COUNT; ++i)
+	{
+		perfCounters.fds[i] = -1;
+		perfCounters.slots[i] = -1;
+	}
+
+#ifdef __linux__
+	const unsigned int types[COUNTER_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+	const unsigned long long configs[COUNTER_COUNT] =
+	{
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	const char *names[COUNTER_COUNT] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch misses" };
+
+	// Cycles lead the group, the rest are optional.
+	int leader = openPerfCounter(types[COUNTER_CYCLES], configs[COUNTER_CYCLES], -1);
+	if (leader < 0)
+	{
+		printf("Hardware counters unavailable (perf_event_open failed, check perf_event_paranoid).\n");
+		return false;
+	}
+	perfCounters.fds[COUNTER_CYCLES] = leader;
+	perfCounters.slots[COUNTER_CYCLES] = perfCounters.opened++;
+
+	for (int i = COUNTER_CYCLES + 1; i < COUNTER_COUNT; ++i)
+	{
+		perfCounters.fds[i] = openPerfCounter(types[i], configs[i], leader);
+		if (perfCounters.fds[i] < 0)
+		{
+			printf("Hardware counter %s unavailable.\n", names[i]);
+			continue;
+		}
+		perfCounters.slots[i] = perfCounters.opened++;
+	}
+
+	ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	perfCounters.enabled = true;
+	return true;
+#else
+	printf("Hardware counters are only supported on Linux.\n");
+	return false;
+#endif
+}
+void readPerfCounters(unsigned long long *values)
+{
+	// One read returns the whole group: count, then one value per counter.
+	unsigned long long buffer[1 + COUNTER_COUNT] = { 0 };
+#ifdef __linux__
+	if (read(perfCounters.fds[COUNTER_CYCLES], buffer, sizeof(buffer)) <= 0)
+		memset(buffer, 0, sizeof(buffer));
+#endif
+	for (int i = 0; i < COUNTER_COUNT; ++i)
+		values[i] = perfCounters.slots[i] >= 0 ? buffer[1 + perfCounters.slots[i]] : 0;
+}
+void printPerfCounters()
+{
+	if (perfCounters.frames == 0)
+		return;
+
+	printf("%-20s %12s %6s %12s %12s %12s\n", "stage", "cycles/frame", "IPC", "L1D miss/px", "LLC miss/px", "br miss/px");
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		unsigned long long *totals = perfCounters.totals[i];
+		double pixels = (double)(profiler.pixels[i] - perfCounters.reportPixels[i]);
+		double ipc = totals[COUNTER_CYCLES] ? (double)totals[COUNTER_INSTRUCTIONS] / totals[COUNTER_CYCLES] : 0.0;
+
+		printf("%-20s %12.0f %6.2f", stageNames[i], (double)totals[COUNTER_CYCLES] / perfCounters.frames, ipc);
+		for (int c = COUNTER_L1D_MISSES; c <= COUNTER_BRANCH_MISSES; ++c)
+		{
+			if (perfCounters.slots[c] < 0 || pixels == 0)
+				printf(" %12s", "-");
+			else
+				printf(" %12.4f", totals[c] / pixels);
+		}
+		printf("\n");
+
+		memset(perfCounters.totals[i], 0, sizeof(perfCounters.totals[i]));
+		perfCounters.reportPixels[i] = profiler.pixels[i];
+	}
+	perfCounters.frames = 0;
+}
+void stopPerfCounters()
+{
+	perfCounters.enabled = false;
+#ifdef __linux__
+	for (int i = 0; i < COUNTER_COUNT; ++i)
+		if (perfCounters.fds[i] >= 0)
+			close(perfCounters.fds[i]);
+#endif
+}
+
+bool openMetrics(const char *name, bool create)
+{
+	// Named shared memory holding one Metrics block.
+#ifdef _WIN32
+	char mappingName[128];
+	snprintf(mappingName, sizeof(mappingName), "Local\\%s", name);
+	HANDLE mapping = create ?
+		CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Metrics), mappingName) :
+		OpenFileMappingA(FILE_MAP_READ, FALSE, mappingName);
+	if (mapping == NULL) { printf("Error opening metrics %s.\n", name); return false; }
+	metrics = (Metrics *)MapViewOfFile(mapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, sizeof(Metrics));
+	if (metrics == NULL) { printf("Error mapping metrics %s.\n", name); CloseHandle(mapping); return false; }
+#else
+	char shmName[128];
+	snprintf(shmName, sizeof(shmName), "/%s", name);
+	int fd = shm_open(shmName, create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+	if (fd < 0) { printf("Error opening metrics %s.\n", name); return false; }
+	if (create && ftruncate(fd, sizeof(Metrics)) != 0) { printf("Error sizing metrics %s.\n", name); close(fd); return false; }
+	void *block = mmap(NULL, sizeof(Metrics), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (block == MAP_FAILED) { printf("Error mapping metrics %s.\n", name); return false; }
+	metrics = (Metrics *)block;
+#endif
+
+	if (create)
+	{
+		memset(metrics, 0, sizeof(Metrics));
+		metrics->version = 1;
+#ifdef _WIN32
+		metrics->pid = (int)GetCurrentProcessId();
+#else
+		metrics->pid = (int)getpid();
+#endif
+		atomicFence();
+		memcpy(metrics->magic, "PRMT", 4);
+		printf("Publishing metrics to shared memory %s.\n", name);
 	}
+	return true;
 }
-void drawWall(int x1, int x2, int b1, int b2, int t1, int t2, int s, int w, int frontBack)
+void closeMetrics(const char *name, bool created)
 {
-	int wt = walls[w].wt; // Get wall texture.
+	if (metrics == NULL)
+		return;
 
-	// Calculate horizontal texture coordinates.
-	float ht = 0;
-	float ht_step = (float)textures[wt].w*walls[w].u / (float)(x2-x1);
+#ifdef _WIN32
+	UnmapViewOfFile(metrics); // The mapping goes away with its last handle.
+#else
+	munmap(metrics, sizeof(Metrics));
+	if (created)
+	{
+		char shmName[128];
+		snprintf(shmName, sizeof(shmName), "/%s", name);
+		shm_unlink(shmName);
+	}
+#endif
+	metrics = NULL;
+}
+int histogramBucket(double ms)
+{
+	unsigned int us = (unsigned int)(ms * 1000.0);
+	int bucket = 0;
+	while (us > 1 && bucket < METRICS_BUCKETS - 1) { us >>= 1; bucket++; }
+	return bucket;
+}
+void publishFrameMetrics(double frameMs, double renderMs)
+{
+	// Seqlock write: readers retry while the sequence is odd or changed.
+	metrics->sequence++;
+	atomicFence();
+
+	metrics->frames++;
+	metrics->ticks = tickCount;
+	metrics->pixels = profiler.pixels[STAGE_DRAW3D];
+	metrics->frameMs = frameMs;
+	metrics->renderMs = renderMs;
+	metrics->uploadMs = profiler.history[(profiler.frame + PROFILE_HISTORY - 1) % PROFILE_HISTORY][STAGE_UPLOAD];
+	metrics->frameHistogram[histogramBucket(frameMs)]++;
+	metrics->uploadHistogram[histogramBucket(metrics->uploadMs)]++;
+
+	atomicFence();
+	metrics->sequence++;
+}
+void publishSecondMetrics(double uptime, int fps, int tickRate)
+{
+	metrics->sequence++;
+	atomicFence();
 
-	// 
-	int dyb = b2 - b1; // Bottom line y distance
-	int dyt = t2 - t1; // Top line y distance
-	int dx = x2 - x1; if (dx == 0) { dx = 1; } // x distance
-	int xs = x1; // Starting Position
+	metrics->uptime = uptime;
+	metrics->fps = fps;
+	metrics->tickRate = tickRate;
 
-	// Clip X
-	if (x1 < 0) { ht -= ht_step * x1; x1 = 0; }
-	if (x2 < 0) { x2 = 0; }
-	if (x1 > buffer_width) { x1 = buffer_width; }
-	if (x2 > buffer_width) { x2 = buffer_width; }
+	atomicFence();
+	metrics->sequence++;
+}
+int readMetrics(const char *name, bool once)
+{
+	if (!openMetrics(name, false))
+		return 1;
 
-	// Draw vertical lines.
-	for (int x = x1; x < x2; ++x)
+	for (;;)
 	{
-		int y1 = dyb * (x - xs + 0.5f) / dx + b1; // Bottom point on y axis
-		int y2 = dyt * (x - xs + 0.5f) / dx + t1; // Top point on y axis
-
-		// Calculate vertical texture coordinates.
-		float vt = 0;
-		float vt_step = (float)textures[wt].h * walls[w].v / (float)(y2 - y1);
-
-		// Clip Y
-		if (y1 < 0) { vt -= vt_step * y1; y1 = 0; }
-		if (y2 < 0) { y2 = 0; }
-		if (y1 > buffer_height) { y1 = buffer_height; }
-		if (y2 > buffer_height) { y2 = buffer_height; }
+		// Seqlock read: copy the block, keep it only if no write overlapped.
+		Metrics snapshot;
+		unsigned int sequence;
+		do
+		{
+			do { sequence = metrics->sequence; } while (sequence & 1);
+			atomicFence();
+			memcpy(&snapshot, (const void *)metrics, sizeof(Metrics));
+			atomicFence();
+		} while (metrics->sequence != sequence);
 
-		// Draw front wall
-		if (frontBack == 0)
+		if (memcmp(snapshot.magic, "PRMT", 4) != 0)
 		{
-			if (sectors[s].surface == 1) { sectors[s].surf[x] = y1; } // Bottom surface top row
-			if (sectors[s].surface == 2) { sectors[s].surf[x] = y2; } // Top Surface top row
+			printf("Metrics block %s is not initialised.\n", name);
+			closeMetrics(name, false);
+			return 1;
+		}
 
-			for (int y = y1; y < y2; ++y)
-			{
-				int textureChannels = 3;
-				int r, g, b, a;
+		printf("pid %i\nuptime %.1f\nframes %llu\nticks %llu\npixels %llu\nfps %.0f\ntick_rate %.0f\nframe_ms %.3f\nrender_ms %.3f\nupload_ms %.3f\n",
+			snapshot.pid, snapshot.uptime, snapshot.frames, snapshot.ticks, snapshot.pixels,
+			snapshot.fps, snapshot.tickRate, snapshot.frameMs, snapshot.renderMs, snapshot.uploadMs);
+		for (int i = 0; i < METRICS_BUCKETS; ++i)
+			if (snapshot.frameHistogram[i] || snapshot.uploadHistogram[i])
+				printf("bucket_us %u frame %u upload %u\n", 1u << i, snapshot.frameHistogram[i], snapshot.uploadHistogram[i]);
+
+		if (once)
+			break;
+		printf("\n");
+		fflush(stdout);
+		sleepSeconds(1.0);
+	}
 
-				int xx = ((int)ht % textures[wt].w) * textureChannels;
-				int yy = (int)(textures[wt].h-((int)vt%textures[wt].h)-1) * textureChannels;
-				int sample = xx + yy * textures[wt].w;
+	closeMetrics(name, false);
+	return 0;
+}
+void sleepSeconds(double seconds)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(seconds * 1000.0));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+#endif
+}
 
-				float shade = 1 - ((walls[w].shade / 2) * 0.01f);
-				r = textures[wt].name[sample] * shade;
-				g = textures[wt].name[sample+1] * shade;
-				b = textures[wt].name[sample+2] * shade;
-				a = 0xff;
+void latencyPresent()
+{
+	// The frame uploaded this loop reached the screen.
+	if (latency.inFlight.upload > 0)
+	{
+		FrameStamps *f = &latency.inFlight;
+		f->present = getTime();
+
+		double *sample = latency.samples[latency.sampleCount % LATENCY_SAMPLES];
+		sample[LATENCY_WAIT_TICK] = (f->tick - f->input) * 1000.0;
+		sample[LATENCY_RENDER] = (f->render - f->tick) * 1000.0;
+		sample[LATENCY_COMPOSITE] = (f->composite - f->render) * 1000.0;
+		sample[LATENCY_UPLOAD] = (f->upload - f->composite) * 1000.0;
+		sample[LATENCY_PRESENT] = (f->present - f->upload) * 1000.0;
+		sample[LATENCY_TOTAL] = (f->present - f->input) * 1000.0;
+		latency.sampleCount++;
+
+		latency.inFlight = (FrameStamps){ 0 };
+	}
 
-				if (r < 0) { r = 0; }
-				if (g < 0) { g = 0; }
-				if (b < 0) { b = 0; }
+	// The frame composited this loop is uploaded and presented next loop.
+	if (latency.rendered.composite > 0)
+	{
+		latency.inFlight = latency.rendered;
+		latency.rendered = (FrameStamps){ 0 };
+	}
+}
+void printLatency(bool all)
+{
+	unsigned int available = latency.sampleCount < LATENCY_SAMPLES ? latency.sampleCount : LATENCY_SAMPLES;
+	unsigned int count = all ? available : latency.sampleCount - latency.reportedCount;
+	if (count > available) { count = available; }
+	latency.reportedCount = latency.sampleCount;
+	if (count == 0)
+		return;
 
-				drawPixel(framebuffer[0], x, y, (RGBA){ r, g, b, a });
+	// Percentiles over the most recent samples.
+	double values[LATENCY_SAMPLES];
+	printf("input latency over %u events (ms)\n  %-32s%8s %8s %8s %8s\n", count, "segment", "p50", "p95", "p99", "max");
+	for (int seg = 0; seg < LATENCY_COUNT; ++seg)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+			values[i] = latency.samples[(latency.sampleCount - 1 - i) % LATENCY_SAMPLES][seg];
+		qsort(values, count, sizeof(double), compareDouble);
 
-				vt += vt_step;
-			}
-			ht += ht_step;
-		}
-		// Draw back wall and surfaces
-		if (frontBack == 1)
-		{
-			int xo = buffer_width / 2;
-			int yo = buffer_height / 2;
-			int x2 = x - xo;
-			int wo;
+		printf("  %-32s%8.2f %8.2f %8.2f %8.2f\n", latencyNames[seg],
+			values[count / 2], values[(count * 95) / 100], values[(count * 99) / 100], values[count - 1]);
+	}
+}
 
-			float tile = sectors[s].ss * 3;
+void waitFor(double seconds)
+{
+	// Sleep for the bulk of the wait, then spin the rest for precision.
+	if (seconds <= 0.0)
+		return;
 
-			if (sectors[s].surface == 1) { y2 = sectors[s].surf[x]; wo = sectors[s].z1; }
-			if (sectors[s].surface == 2) { y1 = sectors[s].surf[x]; wo = sectors[s].z2; }
+	double deadline = getTime() + seconds;
+#ifdef _WIN32
+	const double spin = 0.002; // Sleep() can wake up a scheduler tick late.
+	if (seconds > spin)
+		Sleep((DWORD)((seconds - spin) * 1000.0));
+#elif defined(__linux__)
+	const double spin = 0.0005;
+	if (seconds > spin)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		double bulk = seconds - spin;
+		wake.tv_sec += (time_t)bulk;
+		wake.tv_nsec += (long)((bulk - (double)(time_t)bulk) * 1e9);
+		if (wake.tv_nsec >= 1000000000L) { wake.tv_sec++; wake.tv_nsec -= 1000000000L; }
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+	}
+#else
+	const double spin = 0.001;
+	if (seconds > spin)
+		sleepSeconds(seconds - spin);
+#endif
+	while (getTime() < deadline);
+}
 
-			float lookUpDown = -player.look * (M_PI * 2);
-			if (lookUpDown > buffer_height) { lookUpDown = buffer_height; }
+void watchdogBeginFrame()
+{
+	// draw3D sorts and rewrites sectors, keep the state it starts from.
+	watchdog.player = player;
+	watchdog.sectorCount = sectorCount;
+	watchdog.wallCount = wallCount;
+	memcpy(watchdog.sectors, sectors, sectorCount * sizeof(Sector));
+	if (watchdog.scene)
+		memcpy(watchdog.scene, palettized ? sceneIndices : framebuffer[0], keptSceneSize());
+	watchdog.frameStart = getTime();
+}
+size_t keptSceneSize()
+{
+	// Bytes of the scene an interlaced frame draws half of.
+	return palettized ? scene_width * scene_height : scene_width * scene_height * buffer_channels;
+}
+void watchdogEndFrame()
+{
+	double frameMs = (getTime() - watchdog.frameStart) * 1000.0;
+	if (frameMs <= watchdog.thresholdMs || watchdog.bundles >= WATCHDOG_MAX_BUNDLES)
+		return;
 
-			float moveUpDown = (float)(player.z - wo) / (float)yo;
-			if (moveUpDown == 0) { moveUpDown == 0.001f; }
+	char path[64];
+	snprintf(path, sizeof(path), "slowframe_%u.bundle", watchdog.bundles++);
+	if (writeBundle(path, frameMs))
+		printf("Slow frame: %.2f ms over the %.2f ms budget, wrote %s.\n", frameMs, watchdog.thresholdMs, path);
+}
+bool writeBundle(const char *path, double frameMs)
+{
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) { printf("Error opening bundle %s.\n", path); return false; }
+
+	BundleHeader header = { { 'P', 'R', 'S', 'F' }, 7, buffer_width, buffer_height };
+	header.frameMs = frameMs;
+	header.thresholdMs = watchdog.thresholdMs;
+	header.levelHash = levelHash;
+	header.player = watchdog.player;
+	for (int i = 0; i < STAGE_COUNT; ++i)
+		header.stageMs[i] = profiler.current[i];
+	header.visibleSectors = visibleSectors;
+	header.visibleWalls = visibleWalls;
+	header.sectorCount = watchdog.sectorCount;
+	header.wallCount = watchdog.wallCount;
+	header.hud = profiler.hud;
+	header.overdraw = overdraw.enabled;
+	header.sceneWidth = scene_width;
+	header.sceneHeight = scene_height;
+	header.dynamicResolution = dynamicResolution.enabled;
+	header.palettized = palettized;
+	header.mipmapping = mipmapping;
+	header.swizzled = swizzleSurfaces;
+	header.columnMajor = columnMajor;
+	header.lodDistance = columnLOD.distance;
+	header.lodBudgetMs = columnLOD.budgetMs;
+	header.interlaced = interlace.enabled;
+	header.interlaceParity = interlace.parity;
+
+	fwrite(&header, sizeof(BundleHeader), 1, fp);
+	fwrite(watchdog.sectors, sizeof(Sector), watchdog.sectorCount, fp);
+	fwrite(walls, sizeof(Wall), watchdog.wallCount, fp);
+	fwrite(framebuffer[3], 1, buffer_size, fp);
+	if (dynamicResolution.enabled)
+		fwrite(sceneRows ? sceneRows : framebuffer[0], 1, scene_width * scene_height * buffer_channels, fp);
+	if (interlace.parity >= 0)
+		fwrite(watchdog.scene, 1, keptSceneSize(), fp);
 
-			int ys = y1-yo;
-			int ye = y2-yo;
+	fclose(fp);
+	return true;
+}
+int rerenderBundle(const char *path, const char *outputPath)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) { printf("Error opening bundle %s.\n", path); return 1; }
 
-			for (int y = ys; y < ye; ++y)
-			{
-				float z = y + lookUpDown;
-				if (z == 0) { z = 0.0001f; }
+	BundleHeader header;
+	if (fread(&header, sizeof(BundleHeader), 1, fp) != 1 || memcmp(header.magic, "PRSF", 4) != 0 || header.version != 7)
+	{
+		printf("%s is not a valid bundle.\n", path);
+		fclose(fp);
+		return 1;
+	}
+	if (header.width < 64 || header.width > max_width || header.height < 48 || header.height > max_height ||
+		header.sceneWidth < 1 || header.sceneWidth > header.width || header.sceneHeight < 1 || header.sceneHeight > header.height)
+	{
+		printf("Bundle was captured at an unsupported resolution %ix%i.\n", header.width, header.height);
+		fclose(fp);
+		return 1;
+	}
+	buffer_width = header.width; // Re-render at the captured resolution.
+	buffer_height = header.height;
+	dynamicResolution.enabled = header.dynamicResolution;
+	palettized = header.palettized;
+	mipmapping = header.mipmapping;
+	swizzleSurfaces = header.swizzled;
+	columnMajor = header.columnMajor;
+	columnLOD.distance = header.lodDistance; // As it stood for the frame, the budget isn't followed in a single render.
+	columnLOD.budgetMs = header.lodBudgetMs;
+	interlace.enabled = false; // The captured parity is drawn over the kept columns instead.
+
+	initSharedMemory(palettized);
+	initGame();
+	setSceneResolution(header.sceneWidth, header.sceneHeight);
+
+	// The captured scene follows the frame when it was uploaded separately, then the kept columns of an interlaced one.
+	size_t sceneSize = header.dynamicResolution ? scene_width * scene_height * buffer_channels : 0;
+	size_t keptSize = header.interlaceParity >= 0 ? keptSceneSize() : 0;
+	unsigned char *captured = (unsigned char *)malloc(buffer_size + sceneSize + keptSize);
+	sectorCount = header.sectorCount;
+	wallCount = header.wallCount;
+	bool valid = sectorCount <= 128 && wallCount <= 256 &&
+		fread(sectors, sizeof(Sector), sectorCount, fp) == sectorCount &&
+		fread(walls, sizeof(Wall), wallCount, fp) == wallCount &&
+		fread(captured, 1, buffer_size + sceneSize + keptSize, fp) == buffer_size + sceneSize + keptSize;
+	fclose(fp);
+	if (!valid)
+	{
+		printf("%s is truncated.\n", path);
+		free(captured);
+		freeSharedMemory();
+		cleanupGame();
+		return 1;
+	}
 
-				float fx = x2 / z * moveUpDown * tile;
-				float fy = fov / z * moveUpDown * tile;
+	if (header.levelHash != 0 && header.levelHash != hashLevelFile(level_path))
+		printf("Note: the level file changed since the bundle was captured, the bundle's own level data is used.\n");
+
+	// Re-render the exact frame.
+	player = header.player;
+	overdraw.enabled = header.overdraw;
+	interlace.parity = header.interlaceParity;
+	if (keptSize > 0)
+		memcpy(palettized ? sceneIndices : framebuffer[0], captured + buffer_size + sceneSize, keptSize);
+	render();
+	combineFramebuffers();
+
+	printf("Captured frame: %.2f ms (budget %.2f ms), %i visible sectors, %i visible walls.\n",
+		header.frameMs, header.thresholdMs, header.visibleSectors, header.visibleWalls);
+	printf("%-20s %10s %10s\n", "stage", "captured", "rerender");
+	for (int i = 0; i < STAGE_COUNT; ++i)
+		printf("%-20s %10.3f %10.3f\n", stageNames[i], header.stageMs[i], profiler.current[i]);
+
+	// Compare against the captured frame.
+	unsigned int differing = 0;
+	for (size_t i = 0; i < buffer_size; i += buffer_channels)
+		if (memcmp(&captured[i], &framebuffer[3][i], buffer_channels) != 0)
+			differing++;
+	printf("Re-rendered %i visible sectors, %i visible walls, %u of %u pixels differ%s.\n",
+		visibleSectors, visibleWalls, differing, buffer_width * buffer_height,
+		header.hud ? " (the timing HUD was on and is not reproduced)" : "");
+
+	if (header.dynamicResolution)
+	{
+		const unsigned char *scene = sceneRows ? sceneRows : framebuffer[0];
+		unsigned int sceneDiffering = 0;
+		for (size_t i = 0; i < sceneSize; i += buffer_channels)
+			if (memcmp(&captured[buffer_size + i], &scene[i], buffer_channels) != 0)
+				sceneDiffering++;
+		printf("Scene at %ux%u: %u of %u pixels differ.\n", scene_width, scene_height, sceneDiffering, scene_width * scene_height);
+
+		// Scale the scene under the overlays like the GPU does, for the saved image.
+		unsigned int *dst = (unsigned int *)framebuffer[3];
+		for (size_t y = 0; y < buffer_height; ++y)
+			for (size_t x = 0; x < buffer_width; ++x)
+				if (framebuffer[3][(x + y * buffer_width) * buffer_channels + 3] == 0x00)
+					dst[x + y * buffer_width] = ((const unsigned int *)scene)[x * scene_width / buffer_width + (y * scene_height / buffer_height) * scene_width];
+	}
 
-				float rx = fx * math.sin[player.angle] - fy * math.cos[player.angle] + (player.y / 60 * tile);
-				float ry = fx * math.cos[player.angle] + fy * math.sin[player.angle] - (player.x / 60 * tile);
+	if (outputPath)
+		writePPM(outputPath, framebuffer[3]);
 
-				if (rx < 0) { rx = -rx + 1; }
-				if (ry < 0) { ry = -ry + 1; }
+	free(captured);
+	freeSharedMemory();
+	cleanupGame();
+	return 0;
+}
+bool writePPM(const char *path, const unsigned char *framebuffer)
+{
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) { printf("Error opening %s.\n", path); return false; }
 
-				int st = sectors[s].st;
+	// Framebuffer rows go bottom-up, PPM rows top-down.
+	fprintf(fp, "P6\n%u %u\n255\n", buffer_width, buffer_height);
+	for (int y = buffer_height - 1; y >= 0; --y)
+		for (int x = 0; x < buffer_width; ++x)
+			fwrite(&framebuffer[(x + y * buffer_width) * buffer_channels], 1, 3, fp);
 
-				int textureChannels = 3;
-				int r, g, b, a;
+	fclose(fp);
+	printf("Wrote %s.\n", path);
+	return true;
+}
+
+void overdrawBeginFrame()
+{
+	// Keep the finished frame's totals and reset for the next one.
+	for (int i = 0; i < PASS_COUNT; ++i)
+	{
+		overdraw.lastWrites[i] = overdraw.writes[i];
+		overdraw.writes[i] = 0;
+	}
 
-				int xx = ((int)rx % textures[st].w) * textureChannels;
-				int yy = (int)(textures[st].h-((int)ry%textures[st].h)-1) * textureChannels;
-				int sample = xx + yy * textures[wt].w;
+	overdraw.lastWorstSector = -1;
+	overdraw.lastWorstSectorWrites = 0;
+	for (int s = 0; s < sectorCount; ++s)
+	{
+		if (overdraw.sectorWrites[s] > overdraw.lastWorstSectorWrites)
+		{
+			overdraw.lastWorstSector = s;
+			overdraw.lastWorstSectorWrites = overdraw.sectorWrites[s];
+		}
+		overdraw.sectorWrites[s] = 0;
+	}
 
-				r = textures[st].name[sample];
-				g = textures[st].name[sample + 1];
-				b = textures[st].name[sample + 2];
-				a = 0xff;
+	memset(overdraw.counts, 0, buffer_width * buffer_height * sizeof(unsigned short));
+}
+void drawOverdrawHeatmap(unsigned char *framebuffer)
+{
+	// Black for untouched, then blue, green, yellow, orange and red for 5+ writes.
+	const RGBA heat[6] =
+	{
+		{ 0x00, 0x00, 0x00, 0xff },
+		{ 0x00, 0x00, 0xC0, 0xff },
+		{ 0x00, 0xC0, 0x00, 0xff },
+		{ 0xff, 0xff, 0x00, 0xff },
+		{ 0xff, 0x80, 0x00, 0xff },
+		{ 0xff, 0x00, 0x00, 0xff }
+	};
 
-				drawPixel(framebuffer[0], x2+xo, y+yo, (RGBA){ r, g, b, a });
-			}
+	// Counts are in scene pixels, stretch them over the buffer when the scene is smaller.
+	unsigned int maxCount = 0;
+	unsigned int *dst = (unsigned int *)framebuffer;
+	for (size_t y = 0; y < buffer_height; ++y)
+	{
+		for (size_t x = 0; x < buffer_width; ++x)
+		{
+			unsigned int count = overdraw.counts[x * scene_width / buffer_width + (y * scene_height / buffer_height) * buffer_width];
+			if (count > maxCount) { maxCount = count; }
+			dst[x + y * buffer_width] = heat[count < 5 ? count : 5].rgba;
 		}
 	}
+	overdraw.lastMaxCount = maxCount;
 }
-void clipBehindPlayer(int *x1, int *y1, int *z1, int x2, int y2, int z2)
+void printOverdraw()
 {
-	float da = *y1;
-	float db = y2;
-	float d = da - db; if (d == 0) { d = 1; }
-	float s = da / (da-db);
-	*x1 = *x1 + s * (x2 - (*x1));
-	*y1 = *y1 + s * (y2 - (*y1)); if (*y1 == 0) { *y1 = 1; }
-	*z1 = *z1 + s * (z2 - (*z1));
+	unsigned int sceneWrites = overdraw.lastWrites[PASS_WALLS] + overdraw.lastWrites[PASS_SURFACES];
+	printf("overdraw: %u clear, %u walls, %u surfaces, %u overlay, %u composite writes, %.2f scene writes/pixel, max %u\n",
+		overdraw.lastWrites[PASS_CLEAR], overdraw.lastWrites[PASS_WALLS], overdraw.lastWrites[PASS_SURFACES],
+		overdraw.lastWrites[PASS_OVERLAY], overdraw.lastWrites[PASS_COMPOSITE],
+		(double)sceneWrites / (scene_width * scene_height), overdraw.lastMaxCount);
+	if (overdraw.lastWorstSector >= 0)
+		printf("overdraw: worst sector has walls %i-%i with %u writes\n",
+			sectors[overdraw.lastWorstSector].ws, sectors[overdraw.lastWorstSector].we, overdraw.lastWorstSectorWrites);
 }
-int distance(int x1, int y1, int x2, int y2)
+int drawDigit(unsigned char *framebuffer, int x, int y, int digit, const RGBA color)
 {
-	int dist = sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
-	return dist;
+	// T_NUMBERS holds 3x5 glyphs of 0 to 150 stacked top-down, the ones column is at x 9.
+	const int glyphHeight = 5;
+	const int textureChannels = 3;
+	for (int gy = 0; gy < glyphHeight; ++gy)
+	{
+		for (int gx = 0; gx < 3; ++gx)
+		{
+			int sample = ((digit * glyphHeight + gy) * T_NUMBERS_WIDTH + 9 + gx) * textureChannels;
+			if (T_NUMBERS[sample] != 0)
+				drawPixel(framebuffer, x + gx, y + (glyphHeight - 1 - gy), color); // Framebuffer rows go bottom-up.
+		}
+	}
+	return x + 4;
+}
+int drawNumber(unsigned char *framebuffer, int x, int y, double value, const RGBA color)
+{
+	// Fixed two decimal places, e.g. 12.34
+	if (value > 9999.99) { value = 9999.99; }
+	if (value < 0.0) { value = 0.0; }
+	unsigned int hundredths = (unsigned int)(value * 100.0 + 0.5);
+	unsigned int whole = hundredths / 100;
+
+	char digits[8];
+	int count = 0;
+	do { digits[count++] = whole % 10; whole /= 10; } while (whole > 0);
+	while (count > 0)
+		x = drawDigit(framebuffer, x, y, digits[--count], color);
+
+	drawPixel(framebuffer, x, y, color); // Decimal point.
+	x += 2;
+	x = drawDigit(framebuffer, x, y, (hundredths / 10) % 10, color);
+	x = drawDigit(framebuffer, x, y, hundredths % 10, color);
+	return x;
 }
 
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
 {
 	if (key == GLFW_KEY_ENTER && action == GLFW_PRESS)
-		loadScene();
+		levelReloadPending = true;
+
+	if (key == GLFW_KEY_F3 && action == GLFW_PRESS && trace.enabled)
+		writeTrace();
+
+	if (key == GLFW_KEY_F2 && action == GLFW_PRESS)
+	{
+		overdraw.enabled = !overdraw.enabled;
+		if (!overdraw.enabled)
+			clearBackground(framebuffer[1], (RGBA){ 0x00, 0x00, 0x00, 0x00 });
+	}
+
+	if (key == GLFW_KEY_F1 && action == GLFW_PRESS)
+	{
+		profiler.hud = !profiler.hud;
+		if (!profiler.hud)
+			clearBackground(framebuffer[2], (RGBA){ 0x00, 0x00, 0x00, 0x00 });
+	}
+
+	if (demo.playing) // Demo drives input.
+		return;
 
 	// Player Input.
 	switch (action)
@@ -995,4 +5153,338 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods
 		{
 		} return;
 	}
+
+	// Stamp the first input change the next tick will pick up.
+	if (latency.enabled && latency.pendingInput == 0 &&
+		(key == GLFW_KEY_W || key == GLFW_KEY_A || key == GLFW_KEY_S || key == GLFW_KEY_D ||
+		 key == GLFW_KEY_COMMA || key == GLFW_KEY_PERIOD || key == GLFW_KEY_M))
+		latency.pendingInput = getTime();
+}
+
+void refreshCallback(GLFWwindow *window)
+{
+	// Window contents were damaged, present again even if the view is unchanged.
+	renderOnChange.layersDirty = true;
+}
+
+// Benchmarks
+#define BENCH_WARMUP 3
+#define BENCH_REPS 31
+#define BENCH_MIN_REP_TIME 0.002 // Seconds each repetition should at least take.
+
+struct
+{
+	int x1, x2, b1, b2, t1, t2; // drawWall screen coordinates.
+	int frontBack;
+	unsigned char *dst;
+} benchArgs;
+
+void benchDrawPixel(int n)
+{
+	for (int i = 0; i < n; ++i)
+		for (int y = 0; y < buffer_height; ++y)
+			for (int x = 0; x < buffer_width; ++x)
+				drawPixel(framebuffer[0], x, y, BACKGROUND);
+}
+void benchClearBackground(int n)
+{
+	for (int i = 0; i < n; ++i)
+		clearBackground(framebuffer[0], BACKGROUND);
+}
+void benchCombineFramebuffers(int n)
+{
+	for (int i = 0; i < n; ++i)
+		combineFramebuffers();
+}
+void benchDrawWall(int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		if (benchArgs.frontBack == 1) // Surface pass reads the rows left by the front pass.
+			for (int x = 0; x < buffer_width; ++x)
+				surf[x] = buffer_height;
+		drawWall(benchArgs.x1, benchArgs.x2, benchArgs.b1, benchArgs.b2, benchArgs.t1, benchArgs.t2, 0, 0, benchArgs.frontBack);
+	}
+}
+void benchTransposeColumns(int n)
+{
+	for (int i = 0; i < n; ++i)
+		transposeColumns((unsigned int *)benchArgs.dst, (const unsigned int *)framebuffer[0], buffer_width, buffer_height);
+}
+void benchRender(int n)
+{
+	for (int i = 0; i < n; ++i)
+		render();
+}
+void benchClipBehindPlayer(int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		int x = -40 + (i & 63), y = -(i & 15), z = 10;
+		clipBehindPlayer(&x, &y, &z, 40, 80 + (i & 31), 30);
+		benchArgs.x1 += x + y + z; // Keep the result alive.
+	}
+}
+void benchCopyPixelBuffer(int n)
+{
+	for (int i = 0; i < n; ++i)
+		copyPixelBuffer(benchArgs.dst, framebuffer[3], buffer_size);
+}
+
+int compareDouble(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+int runBenchmarks(const char *outputPath)
+{
+	FILE *out = stdout;
+	if (outputPath)
+	{
+		out = fopen(outputPath, "w");
+		if (out == NULL) { printf("Error opening %s.\n", outputPath); return 1; }
+	}
+
+	// The palette and index buffers are set up either way, for the RGBA against palette runs.
+	initSharedMemory(true);
+	initGame();
+	if (!palettized)
+		buildPalette();
+	benchArgs.dst = (unsigned char *)malloc(buffer_size);
+
+	// Spare layers get some content so the composite does real work.
+	for (int y = 0; y < 16; ++y)
+		for (int x = 0; x < 16; ++x)
+			drawPixel(framebuffer[1], x, y, (RGBA){ 0xff, 0x00, 0xff, 0xff });
+
+	// Bench sector and wall, drawn as sector 0 and wall 0.
+	sectorCount = 1;
+	wallCount = 1;
+	sectors[0] = (Sector){ 0 };
+	sectors[0].ws = 0; sectors[0].we = 1;
+	sectors[0].z1 = 40; sectors[0].z2 = 80;
+	sectors[0].ss = 4;
+	walls[0] = (Wall){ 0 };
+	walls[0].u = 1; walls[0].v = 1;
+	walls[0].shade = 45;
+	fprintf(out, "kernel,params,iterations,min_ns,median_ns,mean_ns,stddev_ns,ns_per_pixel\n");
+
+	Benchmark bench;
+	char resolution[32];
+	snprintf(resolution, sizeof(resolution), "%ux%u%s%s", buffer_width, buffer_height, columnMajor ? " column-major" : "", palettized ? " palette" : "");
+
+	bench = (Benchmark){ "drawPixel", "", benchDrawPixel, buffer_width * buffer_height };
+	snprintf(bench.params, sizeof(bench.params), "%s", resolution);
+	runBenchmark(&bench, out);
+
+	bench = (Benchmark){ "clearBackground", "", benchClearBackground, buffer_width * buffer_height };
+	snprintf(bench.params, sizeof(bench.params), "%s", resolution);
+	runBenchmark(&bench, out);
+
+	bench = (Benchmark){ "combineFramebuffers", "", benchCombineFramebuffers, buffer_width * buffer_height };
+	snprintf(bench.params, sizeof(bench.params), "%s", resolution);
+	runBenchmark(&bench, out);
+
+	// Walls across spans, heights and texture sizes.
+	const int spans[] = { 16, 80, 160 };
+	const int heights[] = { 20, 60, 120 };
+	const int benchTextures[] = { 0, 8, 9 }; // 16x16, 32x32, 64x64.
+	for (int t = 0; t < sizeof(benchTextures) / sizeof(int); ++t)
+	{
+		walls[0].wt = benchTextures[t] < textureCount ? benchTextures[t] : 0;
+		sectors[0].st = walls[0].wt;
+		for (int sp = 0; sp < sizeof(spans) / sizeof(int); ++sp)
+		{
+			for (int h = 0; h < sizeof(heights) / sizeof(int); ++h)
+			{
+				int mid = buffer_height / 2;
+				benchArgs.x1 = (buffer_width - spans[sp]) / 2;
+				benchArgs.x2 = benchArgs.x1 + spans[sp];
+				benchArgs.b1 = benchArgs.b2 = mid - heights[h] / 2;
+				benchArgs.t1 = benchArgs.t2 = mid + heights[h] / 2;
+
+				benchArgs.frontBack = 0;
+				sectors[0].surface = 0;
+				bench = (Benchmark){ "drawWall.front", "", benchDrawWall, spans[sp] * heights[h] };
+				snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i", resolution, spans[sp], heights[h], textures[walls[0].wt].w, textures[walls[0].wt].h);
+				runBenchmark(&bench, out);
+
+				// Surface fills from the wall's bottom edge to the buffer edge.
+				benchArgs.frontBack = 1;
+				sectors[0].surface = 1;
+				bench = (Benchmark){ "drawWall.surface", "", benchDrawWall, spans[sp] * (buffer_height - benchArgs.b1) };
+				snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i", resolution, spans[sp], heights[h], textures[sectors[0].st].w, textures[sectors[0].st].h);
+				runBenchmark(&bench, out);
+			}
+		}
+	}
+
+	// Surfaces at every 10 degrees, column-major against Z-order texels.
+	for (int swizzle = 0; swizzle < 2; ++swizzle)
+	{
+		swizzleSurfaces = swizzle;
+		for (int angle = 0; angle < 360; angle += 10)
+		{
+			player.angle = angle;
+			benchArgs.frontBack = 1;
+			sectors[0].surface = 1;
+			bench = (Benchmark){ "drawWall.surface", "", benchDrawWall, spans[2] * (buffer_height - benchArgs.b1) };
+			snprintf(bench.params, sizeof(bench.params), "%s tex=%ix%i angle=%i %s", resolution, textures[sectors[0].st].w, textures[sectors[0].st].h, angle, swizzle ? "z-order" : "column-major");
+			runBenchmark(&bench, out);
+		}
+	}
+	swizzleSurfaces = false;
+	player.angle = 0;
+
+	// Far wall column LOD against full columns, on the largest wall.
+	const int lodSteps[] = { 2, 4 };
+	for (int l = 0; l < sizeof(lodSteps) / sizeof(int); ++l)
+	{
+		columnLOD.step = lodSteps[l];
+		benchArgs.frontBack = 0;
+		sectors[0].surface = 0;
+		bench = (Benchmark){ "drawWall.front", "", benchDrawWall, spans[2] * heights[2] };
+		snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i lod=%i", resolution, spans[2], heights[2], textures[walls[0].wt].w, textures[walls[0].wt].h, lodSteps[l]);
+		runBenchmark(&bench, out);
+	}
+	columnLOD.step = 1;
+
+	// Largest wall shaded per pixel against the pre-shaded copy.
+	size_t shadeBudget = shadeCache.budget;
+	shadeCache.budget = 0;
+	bench = (Benchmark){ "drawWall.front", "", benchDrawWall, spans[2] * heights[2] };
+	snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i shadecache=off", resolution, spans[2], heights[2], textures[walls[0].wt].w, textures[walls[0].wt].h);
+	runBenchmark(&bench, out);
+	shadeCache.budget = shadeBudget;
+
+	// Short far wall and the surface below it, sampled from the full texture against its mip levels.
+	bool requestedMipmaps = mipmapping;
+	benchArgs.b1 = benchArgs.b2 = buffer_height / 2 - heights[0] / 2;
+	benchArgs.t1 = benchArgs.t2 = buffer_height / 2 + heights[0] / 2;
+	for (int mip = 0; mip < 2; ++mip)
+	{
+		mipmapping = mip;
+		benchArgs.frontBack = 0;
+		sectors[0].surface = 0;
+		bench = (Benchmark){ "drawWall.front", "", benchDrawWall, spans[2] * heights[0] };
+		snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i mipmap=%s", resolution, spans[2], heights[0], textures[walls[0].wt].w, textures[walls[0].wt].h, mip ? "on" : "off");
+		runBenchmark(&bench, out);
+
+		benchArgs.frontBack = 1;
+		sectors[0].surface = 1;
+		bench = (Benchmark){ "drawWall.surface", "", benchDrawWall, spans[2] * (buffer_height - benchArgs.b1) };
+		snprintf(bench.params, sizeof(bench.params), "%s span=%i height=%i tex=%ix%i mipmap=%s", resolution, spans[2], heights[0], textures[sectors[0].st].w, textures[sectors[0].st].h, mip ? "on" : "off");
+		runBenchmark(&bench, out);
+	}
+	mipmapping = requestedMipmaps;
+
+	// Whole level from a fixed camera, full rate against interlaced columns. A chunked level fills in as its loader
+	// thread gets to the chunks, so its runs would depend on the thread's timing and are left out.
+	loadScene();
+	bool wholeLevel = !chunks.enabled;
+	if (!wholeLevel)
+	{
+		stopChunkStreaming();
+		fprintf(stderr, "%s is a chunked level, skipping the whole level runs.\n", level_path);
+	}
+	player = (Player){ 450, 299, 40, 240, 2 };
+	if (wholeLevel)
+	{
+		bench = (Benchmark){ "render", "", benchRender, scene_width * scene_height };
+		snprintf(bench.params, sizeof(bench.params), "%s full", resolution);
+		runBenchmark(&bench, out);
+
+		interlace.enabled = true;
+		bench = (Benchmark){ "render", "", benchRender, scene_width * scene_height };
+		snprintf(bench.params, sizeof(bench.params), "%s interlaced", resolution);
+		runBenchmark(&bench, out);
+		interlace.enabled = false;
+		interlace.parity = -1;
+	}
+
+	// Same camera drawn as RGBA and as palette indices, with the composite that expands them.
+	bool requestedPalette = palettized;
+	for (int indexed = 0; indexed < 2; ++indexed)
+	{
+		palettized = indexed;
+		if (wholeLevel)
+		{
+			bench = (Benchmark){ "render", "", benchRender, scene_width * scene_height };
+			snprintf(bench.params, sizeof(bench.params), "%ux%u%s %s", buffer_width, buffer_height, columnMajor ? " column-major" : "", indexed ? "palette" : "rgba");
+			runBenchmark(&bench, out);
+		}
+
+		bench = (Benchmark){ "combineFramebuffers", "", benchCombineFramebuffers, buffer_width * buffer_height };
+		snprintf(bench.params, sizeof(bench.params), "%ux%u%s %s", buffer_width, buffer_height, columnMajor ? " column-major" : "", indexed ? "palette" : "rgba");
+		runBenchmark(&bench, out);
+	}
+	palettized = requestedPalette;
+
+	bench = (Benchmark){ "clipBehindPlayer", "", benchClipBehindPlayer, 0 };
+	runBenchmark(&bench, out);
+
+	bench = (Benchmark){ "transposeColumns", "", benchTransposeColumns, buffer_width * buffer_height };
+	snprintf(bench.params, sizeof(bench.params), "%s", resolution);
+	runBenchmark(&bench, out);
+
+	bench = (Benchmark){ "copyPixelBuffer", "", benchCopyPixelBuffer, buffer_width * buffer_height };
+	snprintf(bench.params, sizeof(bench.params), "%s", resolution);
+	runBenchmark(&bench, out);
+
+	if (out != stdout)
+		fclose(out);
+
+	free(benchArgs.dst);
+	freeSharedMemory();
+	cleanupGame();
+
+	return 0;
+}
+void runBenchmark(Benchmark *bench, FILE *out)
+{
+	double samples[BENCH_REPS];
+
+	// Find an iteration count long enough for the timer resolution.
+	int iterations = 1;
+	for (;;)
+	{
+		double start = getTime();
+		bench->run(iterations);
+		if (getTime() - start >= BENCH_MIN_REP_TIME || iterations >= (1 << 24))
+			break;
+		iterations *= 2;
+	}
+
+	for (int i = 0; i < BENCH_WARMUP; ++i)
+		bench->run(iterations);
+
+	for (int i = 0; i < BENCH_REPS; ++i)
+	{
+		double start = getTime();
+		bench->run(iterations);
+		samples[i] = (getTime() - start) * 1e9 / iterations;
+	}
+
+	// Statistics in nanoseconds per call.
+	double mean = 0.0;
+	for (int i = 0; i < BENCH_REPS; ++i)
+		mean += samples[i];
+	mean /= BENCH_REPS;
+
+	double variance = 0.0;
+	for (int i = 0; i < BENCH_REPS; ++i)
+		variance += (samples[i] - mean) * (samples[i] - mean);
+	double stddev = sqrt(variance / (BENCH_REPS - 1));
+
+	qsort(samples, BENCH_REPS, sizeof(double), compareDouble);
+	double median = samples[BENCH_REPS / 2];
+
+	fprintf(out, "%s,%s,%i,%.1f,%.1f,%.1f,%.1f,", bench->kernel, bench->params, iterations, samples[0], median, mean, stddev);
+	if (bench->pixels > 0)
+		fprintf(out, "%.3f\n", median / bench->pixels);
+	else
+		fprintf(out, "\n");
+	fflush(out);
 }